@@ -0,0 +1,63 @@
+// Copyright (c) 2024 Takahiro Ishida
+// Licensed under the MIT License.
+
+#pragma once
+
+// Driver specific messages (ICM_USER .. ICM_RESERVED_LOW)
+#define ICM_FFMPEG_SETCACHE			(ICM_USER + 0x0100)
+#define ICM_FFMPEG_GETCACHESTATS	(ICM_USER + 0x0101)
+#define ICM_FFMPEG_GETSTATS			(ICM_USER + 0x0102)
+
+// ICM_FFMPEG_SETCACHE
+//   lParam1: memory budget of the decoded frame cache in bytes (0: disabled)
+//   lParam2: unused
+
+// ICM_FFMPEG_GETCACHESTATS
+//   lParam1: pointer to ICFFMPEGCACHESTATS
+//   lParam2: size of ICFFMPEGCACHESTATS
+typedef struct {
+	DWORD		dwSize;
+	DWORD		dwEntries;
+	DWORDLONG	cbBudget;
+	DWORDLONG	cbUsed;		// frames and payloads kept to replay on a miss
+	DWORDLONG	qwHits;
+	DWORDLONG	qwMisses;
+} ICFFMPEGCACHESTATS;
+
+// ICM_FFMPEG_GETSTATS
+//   lParam1: pointer to ICFFMPEGSTATS
+//   lParam2: size of ICFFMPEGSTATS
+// *Ticks are QueryPerformanceCounter() ticks of qwFrequency per second.
+typedef struct {
+	DWORD		dwSize;
+	DWORD		dwReserved;
+	DWORDLONG	qwFrequency;
+	DWORDLONG	qwFrames;		// frames returned to the caller
+	DWORDLONG	qwDecoded;		// frames decoded by libavcodec
+	DWORDLONG	qwBytesIn;
+	DWORDLONG	qwBytesOut;
+	DWORDLONG	qwDecodeTicks;	// avcodec_send_packet/receive_frame
+	DWORDLONG	qwScaleTicks;	// sws_scale_frame
+	DWORDLONG	qwCopyTicks;	// copy to lpOutput
+} ICFFMPEGSTATS;
+
+// ICM_GETSTATE / ICM_SETSTATE
+//   Defaults are read from the DWORD values of the same names (without the
+//   type prefix) under HKLM and then HKCU "Software\ffmpeg-w32codec\vcmdrv".
+#define ICFFMPEGSTATE_VERSION	1
+
+#define ICFFMPEG_SKIP_NONE		0	// always convert
+#define ICFFMPEG_SKIP_HURRYUP	1	// decode only on HURRYUP/PREROLL
+#define ICFFMPEG_SKIP_NONREF	2	// also drop non-reference frames
+
+typedef struct {
+	DWORD	dwSize;
+	DWORD	dwVersion;
+	DWORD	dwThreads;		// decoder threads (0: auto, 1: off), for the
+							// slice-threaded codecs only; neither msvideo1
+							// nor indeo5 is one
+	DWORD	dwScaler;		// SWS_* algorithm flags
+	DWORD	dwOutputBits;	// preferred output format (16, 24 or 32)
+	DWORD	dwSkipPolicy;	// ICFFMPEG_SKIP_*
+	DWORD	cbCacheBudget;	// see ICM_FFMPEG_SETCACHE
+} ICFFMPEGSTATE;
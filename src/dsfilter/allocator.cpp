@@ -0,0 +1,248 @@
+// Copyright (c) 2024 Takahiro Ishida
+// Licensed under the MIT License.
+
+#include "dsfilter.h"
+
+#include <malloc.h>
+
+// weight of the newest observation in the moving averages, 1/8
+#define EWMA(avg, x)	((avg) == 0 ? (x) : (avg) + ((x) - (avg)) / 8)
+
+static LONGLONG qpc(void)
+{
+	LARGE_INTEGER t;
+	QueryPerformanceCounter(&t);
+	return t.QuadPart;
+}
+
+CFFmpegMediaSample::CFFmpegMediaSample(
+	CBaseAllocator *pAllocator, HRESULT *phr, LONG size, LONG prefix,
+	LONG align)
+	: CMediaSample(NAME("ffmpeg-w32codec Sample"), pAllocator, phr),
+	m_pBase(nullptr), m_acquired(0)
+{
+	// the prefix is rounded up so that GetPointer() stays aligned
+	LONG offset = (prefix + align - 1) / align * align;
+
+	m_pBase = (BYTE *)_aligned_malloc(offset + size, align);
+	if (m_pBase == nullptr) {
+		*phr = E_OUTOFMEMORY;
+		return;
+	}
+	*phr = SetPointer(m_pBase + offset, size);
+}
+
+CFFmpegMediaSample::~CFFmpegMediaSample()
+{
+	if (m_pBase != nullptr) {
+		_aligned_free(m_pBase);
+	}
+}
+
+CFFmpegAllocator::CFFmpegAllocator(
+	LPCTSTR pName, LPUNKNOWN pUnk, HRESULT *phr)
+	: CBaseAllocator(pName, pUnk, phr), m_lMinCount(1), m_lMaxCount(1),
+	m_lastRequest(0), m_interval(0), m_hold(0)
+{
+	LARGE_INTEGER freq;
+
+	QueryPerformanceFrequency(&freq);
+	m_frequency = freq.QuadPart;
+	ZeroMemory(&m_stats, sizeof(m_stats));
+}
+
+CFFmpegAllocator::~CFFmpegAllocator()
+{
+	Decommit();
+	ReallyFree();
+}
+
+STDMETHODIMP CFFmpegAllocator::SetProperties(
+	ALLOCATOR_PROPERTIES *pRequest, ALLOCATOR_PROPERTIES *pActual)
+{
+	CheckPointer(pRequest, E_POINTER);
+	CheckPointer(pActual, E_POINTER);
+	CAutoLock lock(this);
+
+	if ((pRequest->cbBuffer <= 0) || (pRequest->cbPrefix < 0) ||
+		(pRequest->cbAlign <= 0) ||
+		((pRequest->cbAlign & (pRequest->cbAlign - 1)) != 0)) {
+		return VFW_E_BADALIGN;
+	}
+	if (m_bCommitted) {
+		return VFW_E_ALREADY_COMMITTED;
+	}
+	if (m_lAllocated != m_lFree.GetCount()) {
+		return VFW_E_BUFFERS_OUTSTANDING;
+	}
+
+	pActual->cbBuffer = m_lSize = pRequest->cbBuffer;
+	pActual->cBuffers = m_lCount =
+		max(pRequest->cBuffers, (LONG)ALLOCATOR_MIN_BUFFERS);
+	pActual->cbAlign = m_lAlignment =
+		max(pRequest->cbAlign, (LONG)ALLOCATOR_ALIGN);
+	pActual->cbPrefix = m_lPrefix = pRequest->cbPrefix;
+	m_bChanged = TRUE;
+
+	// the requested count is the floor, more are added on demand
+	m_lMinCount = m_lCount;
+	m_lMaxCount = max(m_lCount, (LONG)ALLOCATOR_MAX_BUFFERS);
+
+	return S_OK;
+}
+
+STDMETHODIMP CFFmpegAllocator::GetBuffer(
+	IMediaSample **ppBuffer, REFERENCE_TIME *pStartTime,
+	REFERENCE_TIME *pEndTime, DWORD dwFlags)
+{
+	HRESULT hr;
+	LONGLONG t0 = qpc();
+	LONGLONG t1;
+	bool empty;
+
+	{
+		CAutoLock lock(this);
+
+		if (m_lastRequest != 0) {
+			m_interval = EWMA(m_interval, t0 - m_lastRequest);
+		}
+		m_lastRequest = t0;
+
+		// grow instead of waiting while the pool is below what the
+		// observed hold time needs
+		empty = (m_lFree.GetCount() == 0);
+		if (empty && m_bCommitted && (m_lAllocated < GetDesiredCount())) {
+			CMediaSample *pSample = NewSample();
+			if (pSample != nullptr) {
+				m_lFree.Add(pSample);
+				m_lAllocated++;
+				m_stats.grown++;
+				empty = false;
+			}
+		}
+	}
+
+	hr = CBaseAllocator::GetBuffer(ppBuffer, pStartTime, pEndTime, dwFlags);
+	t1 = qpc();
+
+	if (SUCCEEDED(hr)) {
+		CAutoLock lock(this);
+
+		static_cast<CFFmpegMediaSample *>(*ppBuffer)->m_acquired = t1;
+		m_stats.requests++;
+		if (empty) {
+			m_stats.waits++;
+			m_stats.waitUs += (t1 - t0) * 1000000 / m_frequency;
+			m_stats.maxWaitUs = max(
+				m_stats.maxWaitUs, (t1 - t0) * 1000000 / m_frequency);
+		}
+		m_stats.peakBuffers = max(m_stats.peakBuffers, (LONGLONG)m_lAllocated);
+	}
+
+	return hr;
+}
+
+STDMETHODIMP CFFmpegAllocator::ReleaseBuffer(IMediaSample *pBuffer)
+{
+	CheckPointer(pBuffer, E_POINTER);
+	CFFmpegMediaSample *pSample = static_cast<CFFmpegMediaSample *>(pBuffer);
+
+	{
+		CAutoLock lock(this);
+
+		m_hold = EWMA(m_hold, qpc() - pSample->m_acquired);
+
+		// shrink back once the downstream holds buffers for less time
+		if (m_bCommitted && !m_bDecommitInProgress && (m_lWaiting == 0) &&
+			(m_lAllocated > GetDesiredCount())) {
+			m_lAllocated--;
+			m_stats.shrunk++;
+			delete pSample;
+			return NOERROR;
+		}
+	}
+
+	return CBaseAllocator::ReleaseBuffer(pBuffer);
+}
+
+void CFFmpegAllocator::GetStats(allocator_stats_t *stats)
+{
+	CAutoLock lock(this);
+
+	*stats = m_stats;
+	stats->buffers = m_lAllocated;
+	stats->holdUs = m_hold * 1000000 / m_frequency;
+}
+
+HRESULT CFFmpegAllocator::Alloc(void)
+{
+	CAutoLock lock(this);
+	HRESULT hr;
+
+	hr = CBaseAllocator::Alloc();
+	if (FAILED(hr)) {
+		return hr;
+	}
+	if ((hr == S_FALSE) && (m_lAllocated > 0)) {
+		return S_OK;
+	}
+
+	ReallyFree();
+
+	while (m_lAllocated < m_lCount) {
+		CMediaSample *pSample = NewSample();
+		if (pSample == nullptr) {
+			return E_OUTOFMEMORY;
+		}
+		m_lFree.Add(pSample);
+		m_lAllocated++;
+	}
+
+	m_bChanged = FALSE;
+
+	return S_OK;
+}
+
+void CFFmpegAllocator::Free(void)
+{
+	// keep the buffers until the next Commit() or the destruction
+}
+
+void CFFmpegAllocator::ReallyFree(void)
+{
+	CMediaSample *pSample;
+
+	while ((pSample = m_lFree.RemoveHead()) != nullptr) {
+		delete pSample;
+	}
+	m_lAllocated = 0;
+}
+
+CMediaSample * CFFmpegAllocator::NewSample(void)
+{
+	HRESULT hr = S_OK;
+	CFFmpegMediaSample *pSample = new CFFmpegMediaSample(
+		this, &hr, m_lSize, m_lPrefix, m_lAlignment);
+
+	if (FAILED(hr)) {
+		LOGE("new CFFmpegMediaSample() failed. (0x%08x)", hr);
+		delete pSample;
+		return nullptr;
+	}
+
+	return pSample;
+}
+
+LONG CFFmpegAllocator::GetDesiredCount(void) const
+{
+	LONG count;
+
+	// Little's law: buffers in use = request rate * hold time, plus one
+	// being filled
+	if ((m_interval <= 0) || (m_hold <= 0)) {
+		return m_lMinCount;
+	}
+	count = (LONG)((m_hold + m_interval - 1) / m_interval) + 1;
+
+	return min(max(count, m_lMinCount), m_lMaxCount);
+}
@@ -0,0 +1,66 @@
+// Copyright (c) 2024 Takahiro Ishida
+// Licensed under the MIT License.
+
+#include "dsfilter.h"
+
+CBlockCache::CBlockCache(size_t budget)
+	: m_budget(budget), m_used(0), m_hits(0), m_misses(0)
+{
+}
+
+CBlockCache::~CBlockCache()
+{
+	LOGI("block cache: %llu hits, %llu misses", m_hits, m_misses);
+
+	for (page_t *page : m_lru) {
+		delete page;
+	}
+}
+
+CBlockCache::page_t *CBlockCache::Find(LONGLONG index)
+{
+	auto it = m_map.find(index);
+	if (it == m_map.end()) {
+		m_misses++;
+		return nullptr;
+	}
+
+	// move to the most recently used position
+	m_lru.splice(m_lru.begin(), m_lru, it->second);
+	m_hits++;
+
+	return *it->second;
+}
+
+CBlockCache::page_t *CBlockCache::Insert(LONGLONG index)
+{
+	page_t *page;
+
+	if ((m_used + BLOCK_CACHE_PAGE_SIZE > m_budget) && !m_lru.empty()) {
+		// recycle the least recently used page
+		page = m_lru.back();
+		m_map.erase(page->index);
+		m_lru.pop_back();
+	} else {
+		page = new page_t;
+		m_used += BLOCK_CACHE_PAGE_SIZE;
+	}
+
+	page->index = index;
+	page->length = 0;
+	m_lru.push_front(page);
+	m_map[index] = m_lru.begin();
+
+	return page;
+}
+
+void CBlockCache::Remove(page_t *page)
+{
+	auto it = m_map.find(page->index);
+	if (it != m_map.end()) {
+		m_lru.erase(it->second);
+		m_map.erase(it);
+	}
+	m_used -= BLOCK_CACHE_PAGE_SIZE;
+	delete page;
+}
@@ -17,9 +17,17 @@ CFFmpegDSFilter::CFFmpegDSFilter(LPUNKNOWN pUnk, HRESULT *phr)
 	m_pVideoOut(nullptr), m_pAudioOut(nullptr), m_pAVFormatContext(nullptr),
 	m_pVideoCodecContext(nullptr), m_pAudioCodecContext(nullptr),
 	m_pSwsContext(nullptr), m_pSwrContext(nullptr),
-	m_videoStreamIndex(-1), m_audioStreamIndex(-1)
+	m_audioConvert(AUDIO_CONVERT_SWR), m_audioSrcFormat(AV_SAMPLE_FMT_NONE),
+	m_audioSrcChannels(0), m_audioSrcRate(0),
+	m_videoStreamIndex(-1), m_audioStreamIndex(-1),
+	m_indexStreamIndex(-1), m_pooled(false),
+	m_rtStartTime(0), m_rtStart(0), m_rtStop(MAX_TIME)
 {
-	unsigned char *buf = (unsigned char *)av_malloc(AVIO_BUFFER_SIZE);
+	unsigned char *buf;
+
+	m_pooled = (get_config_value("SharedPool", 0) != 0);
+
+	buf = (unsigned char *)av_malloc(AVIO_BUFFER_SIZE);
 	if (buf == nullptr) {
 		LOGE("av_malloc() failed.");
 		*phr = E_OUTOFMEMORY;
@@ -43,6 +51,8 @@ CFFmpegDSFilter::CFFmpegDSFilter(LPUNKNOWN pUnk, HRESULT *phr)
 
 CFFmpegDSFilter::~CFFmpegDSFilter()
 {
+	m_keyframeIndex.Save();
+
 	if (m_pStreamIn != nullptr) {
 		delete m_pStreamIn;
 	}
@@ -89,27 +99,61 @@ HRESULT CFFmpegDSFilter::Init(void)
 	AVFormatContext *fmt;
 	const AVStream *stream;
 	const AVCodec *codec;
+	CProbeCache probeCache;
+	WCHAR key[CACHE_KEY_LENGTH];
+	bool keyed = false;
+	bool probed = false;
+	DWORD value;
 	int ret;
 	int index;
 
 	fmt = avformat_alloc_context();
 	fmt->pb = m_pAVIOContext;
 
+	// reading from a mapping costs no more than copying out of the AVIO
+	// buffer, so let avio_read() copy the payload straight into packets
+	m_pAVIOContext->direct = m_pStreamIn->IsFileMapped()? 1:0;
+
 	ret = avformat_open_input(&fmt, nullptr, nullptr, nullptr);
 	if (ret < 0) {
 		LOGE("avformat_open_input() failed. (%d)", ret);
 		goto failed;
 	}
 
-	if (fmt->probesize > AVIO_BUFFER_SIZE) {
-		fmt->probesize = AVIO_BUFFER_SIZE;
+	// both caches are keyed by the same hash of the input
+	if (get_config_value("ProbeCache", 1) ||
+		get_config_value("KeyframeIndex", 1)) {
+		keyed = get_cache_key(m_pStreamIn, key, ARRAYSIZE(key));
 	}
-	ret = avformat_find_stream_info(fmt, nullptr);
-	if (ret < 0) {
-		LOGW("avformat_find_stream_info() failed. (%d)", ret);
-		// continue
+
+	// avformat_find_stream_info() decodes frames only to learn what the
+	// demuxer could not tell, which is the same every time for a file.
+	// A demuxer without a header (mpegps) creates its streams, and sets up
+	// their parsers, only while reading, there is nothing to restore then.
+	if (keyed && get_config_value("ProbeCache", 1) &&
+		!(fmt->ctx_flags & AVFMTCTX_NOHEADER) && probeCache.Open(key)) {
+		probed = probeCache.Apply(fmt);
+	}
+	if (!probed) {
+		fmt->probesize =
+			max(get_config_value("ProbeSize", PROBE_SIZE), (DWORD)32);
+		value = get_config_value("AnalyzeDuration", 0);
+		if (value > 0) {
+			fmt->max_analyze_duration = value * 1000LL;
+		}
+		ret = avformat_find_stream_info(fmt, nullptr);
+		if (ret < 0) {
+			LOGW("avformat_find_stream_info() failed. (%d)", ret);
+			// continue
+		} else {
+			probeCache.Save(fmt);
+		}
 	}
 
+	// an MPEG-PS file rarely starts at 0, the timeline does
+	m_rtStartTime = (fmt->start_time != AV_NOPTS_VALUE)?
+		av_rescale(fmt->start_time, 10000000, AV_TIME_BASE):0;
+
 	index = av_find_best_stream(fmt, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
 	if (index >= 0) {
 		stream = fmt->streams[index];
@@ -121,6 +165,10 @@ HRESULT CFFmpegDSFilter::Init(void)
 		m_pVideoCodecContext = avcodec_alloc_context3(codec);
 		m_pVideoCodecContext->width = stream->codecpar->width;
 		m_pVideoCodecContext->height = stream->codecpar->height;
+		m_pVideoCodecContext->thread_count =
+			get_config_value("Threads", m_pooled? 1:DECODER_THREADS);
+		m_pVideoCodecContext->thread_type =
+			get_config_value("ThreadType", DECODER_THREAD_TYPE);
 		if (0 != avcodec_open2(m_pVideoCodecContext, codec, nullptr)) {
 			LOGE("avcodec_open2() failed.");
 			goto failed;
@@ -151,6 +199,9 @@ HRESULT CFFmpegDSFilter::Init(void)
 		m_pAudioCodecContext->block_align = stream->codecpar->block_align;
 		m_pAudioCodecContext->bits_per_coded_sample =
 			stream->codecpar->bits_per_coded_sample;
+		// the MPEG audio decoders can output interleaved float, which the
+		// renderer takes as is
+		m_pAudioCodecContext->request_sample_fmt = AV_SAMPLE_FMT_FLT;
 		if (0 != avcodec_open2(m_pAudioCodecContext, codec, nullptr)) {
 			LOGE("avcodec_open2() failed.");
 			goto failed;
@@ -167,11 +218,27 @@ HRESULT CFFmpegDSFilter::Init(void)
 	}
 	m_audioStreamIndex = index;
 
+	// index the demuxers that keep no complete index of their own, the
+	// entries made during a previous playback let libavformat seek without
+	// scanning
+	index = (m_videoStreamIndex >= 0)? m_videoStreamIndex:m_audioStreamIndex;
+	m_indexStreamIndex = -1;
+	if ((index >= 0) &&
+		!CKeyframeIndex::IsCovered(fmt, fmt->streams[index]) &&
+		get_config_value("KeyframeIndex", 1)) {
+		if (keyed && m_keyframeIndex.Open(key, fmt->streams[index])) {
+			m_keyframeIndex.Apply(fmt->streams[index]);
+			m_indexStreamIndex = index;
+		}
+	}
+
 	if (m_pAVFormatContext != nullptr) {
 		avformat_free_context(m_pAVFormatContext);
 	}
 	m_pAVFormatContext = fmt;
 
+	UpdateStreamDiscard(nullptr);
+
 	return S_OK;
 
 failed:
@@ -179,23 +246,87 @@ failed:
 	return E_FAIL;
 }
 
-int CFFmpegDSFilter::Decode(AVFrame *frame, const AVPacket *packet)
+void CFFmpegDSFilter::UpdateStreamDiscard(CFFmpegStreamOut *pDisconnecting)
 {
-	int ret;
-	AVCodecContext *avctx;
+	CAutoLock lock(this);
+	AVFormatContext *fmt = m_pAVFormatContext;
+	bool video;
+	bool audio;
+
+	if (fmt == nullptr) {
+		return;
+	}
 
-	if (packet->stream_index == m_videoStreamIndex) {
-		avctx = m_pVideoCodecContext;
-	} else if (packet->stream_index == m_audioStreamIndex) {
-		avctx = m_pAudioCodecContext;
+	video = (m_pVideoOut != nullptr) && (m_pVideoOut != pDisconnecting) &&
+		m_pVideoOut->IsConnected();
+	audio = (m_pAudioOut != nullptr) && (m_pAudioOut != pDisconnecting) &&
+		m_pAudioOut->IsConnected();
+
+	for (unsigned int i=0; i<fmt->nb_streams; i++) {
+		if (((int)i == m_videoStreamIndex) && video) {
+			fmt->streams[i]->discard = AVDISCARD_DEFAULT;
+		} else if (((int)i == m_audioStreamIndex) && audio) {
+			fmt->streams[i]->discard = AVDISCARD_DEFAULT;
+		} else if ((int)i == m_indexStreamIndex) {
+			// keyframes still feed the seek index
+			fmt->streams[i]->discard = AVDISCARD_NONKEY;
+		} else {
+			fmt->streams[i]->discard = AVDISCARD_ALL;
+		}
+	}
+
+	LOGD("%s: video %d, audio %d, %u streams", __FUNCTION__,
+		video, audio, fmt->nb_streams);
+}
+
+AVCodecContext * CFFmpegDSFilter::GetCodecContext(int stream_index)
+{
+	if (stream_index == m_videoStreamIndex) {
+		return m_pVideoCodecContext;
+	} else if (stream_index == m_audioStreamIndex) {
+		return m_pAudioCodecContext;
 	} else {
+		return nullptr;
+	}
+}
+
+int CFFmpegDSFilter::SendPacket(int stream_index, const AVPacket *packet)
+{
+	int ret;
+	AVCodecContext *avctx = GetCodecContext(stream_index);
+
+	if (avctx == nullptr) {
 		return -1;
 	}
 
 	ret = avcodec_send_packet(avctx, packet);
 	if (ret < 0) {
 		LOGE("avcodec_send_packet() failed. (%d)", ret);
-		return ret;
+	}
+
+	return ret;
+}
+
+void CFFmpegDSFilter::SetDecoderSkip(
+	int stream_index, AVDiscard skip_frame, AVDiscard skip_loop_filter)
+{
+	AVCodecContext *avctx = GetCodecContext(stream_index);
+
+	if (avctx == nullptr) {
+		return;
+	}
+
+	avctx->skip_frame = skip_frame;
+	avctx->skip_loop_filter = skip_loop_filter;
+}
+
+int CFFmpegDSFilter::ReceiveFrame(int stream_index, AVFrame *frame)
+{
+	int ret;
+	AVCodecContext *avctx = GetCodecContext(stream_index);
+
+	if (avctx == nullptr) {
+		return -1;
 	}
 
 	ret = avcodec_receive_frame(avctx, frame);
@@ -208,27 +339,138 @@ int CFFmpegDSFilter::Decode(AVFrame *frame, const AVPacket *packet)
 	return ret;
 }
 
-size_t CFFmpegDSFilter::ConvertVideoFrame(
-	AVFrame *dst, const AVFrame *src, const VIDEOINFOHEADER *vih,
+void CFFmpegDSFilter::FlushDecoder(int stream_index)
+{
+	AVCodecContext *avctx = GetCodecContext(stream_index);
+
+	// leaves the draining state so that decoding can resume after a seek
+	if (avctx != nullptr) {
+		avcodec_flush_buffers(avctx);
+	}
+}
+
+LONG CFFmpegDSFilter::ScaleVideoFrame(
+	BYTE *dst, LONG size, const AVFrame *src, const VIDEOINFOHEADER *vih,
 	REFGUID subtype)
 {
 	int ret;
+	int width = vih->rcTarget.right - vih->rcTarget.left;
+	int height = vih->rcTarget.bottom - vih->rcTarget.top;
+	AVPixelFormat format = get_pixel_format(subtype);
+	uint8_t *dst_data[4];
+	int dst_linesize[4];
+	LONG image_size;
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+	int shift;
+
+	image_size = get_video_planes(vih, subtype, dst, dst_data, dst_linesize);
+	if (image_size > size) {
+		LOGE("sample too small (%d < %d)", size, image_size);
+		return -1;
+	}
+
+	// a renderer may ask for a stride wider than the picture
+	if ((width <= 0) || (height <= 0)) {
+		width = vih->bmiHeader.biWidth;
+		height = abs(vih->bmiHeader.biHeight);
+	} else if (desc != nullptr) {
+		// the picture goes to the origin of rcTarget
+		for (int i=0; (i<4) && (dst_data[i] != nullptr); i++) {
+			shift = ((i == 1) || (i == 2))? desc->log2_chroma_h:0;
+			dst_data[i] += (vih->rcTarget.top >> shift) * dst_linesize[i] +
+				av_image_get_linesize(format, vih->rcTarget.left, i);
+		}
+	}
+
+	if ((src->format == format) &&
+		(src->width == width) && (src->height == height)) {
+		av_image_copy(dst_data, dst_linesize,
+			(const uint8_t **)src->data, src->linesize, format, width, height);
+		return image_size;
+	}
 
 	m_pSwsContext = sws_getCachedContext(
 		m_pSwsContext,
-		m_pVideoCodecContext->width, m_pVideoCodecContext->height,
-		m_pVideoCodecContext->pix_fmt,
-		vih->bmiHeader.biWidth, abs(vih->bmiHeader.biHeight),
-		get_pixel_format(subtype),
+		src->width, src->height, (AVPixelFormat)src->format,
+		width, height, format,
 		SWS_FAST_BILINEAR, nullptr, nullptr, nullptr);
+	if (m_pSwsContext == nullptr) {
+		LOGE("sws_getCachedContext() failed.");
+		return -1;
+	}
 
-	ret = sws_scale_frame(m_pSwsContext, dst, src);
+	ret = sws_scale(m_pSwsContext, src->data, src->linesize, 0, src->height,
+		dst_data, dst_linesize);
 	if (ret < 0) {
-		LOGE("sws_scale_frame() failed. (%d)", ret);
-		return (size_t)-1;
+		LOGE("sws_scale() failed. (%d)", ret);
+		return -1;
+	}
+
+	return image_size;
+}
+
+AVSampleFormat CFFmpegDSFilter::GetAudioFormat(AVChannelLayout *ch_layout)
+{
+	if (m_pAudioCodecContext == nullptr) {
+		return AV_SAMPLE_FMT_NONE;
 	}
+	av_channel_layout_copy(ch_layout, &m_pAudioCodecContext->ch_layout);
 
-	return dst->linesize[0] * vih->bmiHeader.biHeight;
+	return m_pAudioCodecContext->sample_fmt;
+}
+
+void CFFmpegDSFilter::SetAudioOutput(const WAVEFORMATEX *wfx)
+{
+	static const char *names[] = {
+		"swresample", "none", "flt -> s16", "fltp -> flt"
+	};
+
+	if (m_pAudioCodecContext == nullptr) {
+		return;
+	}
+
+	// the output format may have changed since the last connection
+	if (m_pSwrContext != nullptr) {
+		swr_free(&m_pSwrContext);
+	}
+
+	SelectAudioConversion(m_pAudioCodecContext->sample_fmt,
+		&m_pAudioCodecContext->ch_layout, m_pAudioCodecContext->sample_rate,
+		wfx);
+	LOGI("audio conversion: %s", names[m_audioConvert]);
+}
+
+void CFFmpegDSFilter::SelectAudioConversion(
+	AVSampleFormat format, const AVChannelLayout *ch_layout,
+	int sample_rate, const WAVEFORMATEX *wfx)
+{
+	AVSampleFormat dst_format = get_sample_format(wfx);
+	AVChannelLayout dst_layout;
+	bool same_layout;
+
+	get_channel_layout(wfx, &dst_layout);
+	same_layout = (ch_layout->nb_channels == wfx->nChannels) &&
+		((ch_layout->order == AV_CHANNEL_ORDER_UNSPEC) ||
+		 (av_channel_layout_compare(ch_layout, &dst_layout) == 0));
+	av_channel_layout_uninit(&dst_layout);
+
+	m_audioConvert = AUDIO_CONVERT_SWR;
+	if (same_layout && (sample_rate == (int)wfx->nSamplesPerSec)) {
+		if (format == dst_format) {
+			m_audioConvert = AUDIO_CONVERT_NONE;
+		} else if (((format == AV_SAMPLE_FMT_FLTP) ||
+			 (format == AV_SAMPLE_FMT_FLT)) &&
+			(dst_format == AV_SAMPLE_FMT_S16)) {
+			m_audioConvert = AUDIO_CONVERT_FLT_S16;
+		} else if ((format == AV_SAMPLE_FMT_FLTP) &&
+			(dst_format == AV_SAMPLE_FMT_FLT)) {
+			m_audioConvert = AUDIO_CONVERT_FLTP_FLT;
+		}
+	}
+
+	m_audioSrcFormat = format;
+	m_audioSrcChannels = ch_layout->nb_channels;
+	m_audioSrcRate = sample_rate;
 }
 
 size_t CFFmpegDSFilter::ConvertAudioFrame(
@@ -236,10 +478,50 @@ size_t CFFmpegDSFilter::ConvertAudioFrame(
 {
 	int ret;
 
-	av_channel_layout_default(&dst->ch_layout, wfx->nChannels);
+	// a decoder may still change its output in the middle of the stream
+	if ((src->format != m_audioSrcFormat) ||
+		(src->ch_layout.nb_channels != m_audioSrcChannels) ||
+		(src->sample_rate != m_audioSrcRate)) {
+		SelectAudioConversion((AVSampleFormat)src->format, &src->ch_layout,
+			src->sample_rate, wfx);
+	}
+
+	if (m_audioConvert == AUDIO_CONVERT_NONE) {
+		ret = av_frame_ref(dst, src);
+		if (ret < 0) {
+			LOGE("av_frame_ref() failed. (%d)", ret);
+			return (size_t)-1;
+		}
+		return dst->nb_samples * wfx->nBlockAlign;
+	}
+
+	get_channel_layout(wfx, &dst->ch_layout);
 	dst->sample_rate = wfx->nSamplesPerSec;
 	dst->format = get_sample_format(wfx);
 
+	if ((m_audioConvert == AUDIO_CONVERT_FLT_S16) ||
+		(m_audioConvert == AUDIO_CONVERT_FLTP_FLT)) {
+		const float * const *planes =
+			(const float * const *)src->extended_data;
+		dst->nb_samples = src->nb_samples;
+		ret = av_frame_get_buffer(dst, 0);
+		if (ret < 0) {
+			LOGE("av_frame_get_buffer() failed. (%d)", ret);
+			return (size_t)-1;
+		}
+		if (m_audioConvert == AUDIO_CONVERT_FLTP_FLT) {
+			convert_fltp_to_flt((float *)dst->data[0], planes,
+				wfx->nChannels, src->nb_samples);
+		} else if (src->format == AV_SAMPLE_FMT_FLT) {
+			convert_fltp_to_s16((int16_t *)dst->data[0], planes,
+				1, src->nb_samples * wfx->nChannels);
+		} else {
+			convert_fltp_to_s16((int16_t *)dst->data[0], planes,
+				wfx->nChannels, src->nb_samples);
+		}
+		return dst->nb_samples * wfx->nBlockAlign;
+	}
+
 	if (m_pSwrContext == nullptr) {
 		ret = swr_alloc_set_opts2(
 			&m_pSwrContext, &dst->ch_layout,
@@ -290,6 +572,14 @@ int CFFmpegDSFilter::GetPinCount()
 	return ret;
 }
 
+CFFmpegStreamOut * CFFmpegDSFilter::GetSeekingPin(void)
+{
+	if ((m_pVideoOut != nullptr) && m_pVideoOut->IsConnected()) {
+		return m_pVideoOut;
+	}
+	return m_pAudioOut;
+}
+
 CBasePin * CFFmpegDSFilter::GetPin(int n)
 {
 	switch (n)
@@ -320,10 +610,8 @@ STDMETHODIMP CFFmpegDSFilter::Stop()
 {
 	HRESULT hr;
 
-	if (ThreadExists()) {
-		CallWorker(THREAD_REQ_EXIT);
-		Close();
-	}
+	StopDemux();
+	m_keyframeIndex.Save();
 	hr = CBaseFilter::Stop();
 	if (FAILED(hr) && (hr != VFW_E_NO_ALLOCATOR)) {
 		LOGE("CBaseFilter::Stop() failed. (0x%08x)", hr);
@@ -339,9 +627,7 @@ STDMETHODIMP CFFmpegDSFilter::Pause()
 	if (FAILED(hr)) {
 		return hr;
 	}
-	if (!ThreadExists()) {
-		Create();
-	}
+	StartDemux();
 
 	return S_OK;
 }
@@ -366,8 +652,19 @@ STDMETHODIMP CFFmpegDSFilter::GetCapabilities(DWORD *pCapabilities)
 
 STDMETHODIMP CFFmpegDSFilter::CheckCapabilities(DWORD *pCapabilities)
 {
-	LOGW("%s", __FUNCTION__);
-	return E_NOTIMPL;
+	DWORD caps;
+
+	GetCapabilities(&caps);
+	if ((*pCapabilities & caps) == 0) {
+		*pCapabilities = 0;
+		return E_FAIL;
+	}
+	if ((*pCapabilities & caps) != *pCapabilities) {
+		*pCapabilities &= caps;
+		return S_FALSE;
+	}
+
+	return S_OK;
 }
 
 STDMETHODIMP CFFmpegDSFilter::IsFormatSupported(const GUID *pFormat)
@@ -386,14 +683,14 @@ STDMETHODIMP CFFmpegDSFilter::IsFormatSupported(const GUID *pFormat)
 
 STDMETHODIMP CFFmpegDSFilter::QueryPreferredFormat(GUID *pFormat)
 {
-	LOGW("%s", __FUNCTION__);
-	return E_NOTIMPL;
+	*pFormat = TIME_FORMAT_MEDIA_TIME;
+	return S_OK;
 }
 
 STDMETHODIMP CFFmpegDSFilter::GetTimeFormat(GUID *pFormat)
 {
-	LOGW("%s", __FUNCTION__);
-	return E_NOTIMPL;
+	*pFormat = TIME_FORMAT_MEDIA_TIME;
+	return S_OK;
 }
 
 STDMETHODIMP CFFmpegDSFilter::IsUsingTimeFormat(const GUID *pFormat)
@@ -431,36 +728,189 @@ STDMETHODIMP CFFmpegDSFilter::GetDuration(LONGLONG *pDuration)
 
 STDMETHODIMP CFFmpegDSFilter::GetStopPosition(LONGLONG *pStop)
 {
+	CAutoLock lock(this);
+
+	if (m_rtStop != MAX_TIME) {
+		*pStop = m_rtStop;
+		return S_OK;
+	}
 	return GetDuration(pStop);
 }
 
 STDMETHODIMP CFFmpegDSFilter::GetCurrentPosition(LONGLONG *pCurrent)
 {
-	LOGW("%s", __FUNCTION__);
-	return E_NOTIMPL;
+	CFFmpegStreamOut *pin = GetSeekingPin();
+
+	if (pin == nullptr) {
+		return E_FAIL;
+	}
+	*pCurrent = pin->GetPosition();
+
+	return S_OK;
 }
 
 STDMETHODIMP CFFmpegDSFilter::ConvertTimeFormat(
 	LONGLONG *pTarget, const GUID *pTargetFormat, LONGLONG Source,
 	const GUID *pSourceFormat)
 {
-	LOGW("%s", __FUNCTION__);
-	return E_NOTIMPL;
+	// only TIME_FORMAT_MEDIA_TIME is supported, nullptr means the current
+	if (((pTargetFormat != nullptr) &&
+		 (*pTargetFormat != TIME_FORMAT_MEDIA_TIME)) ||
+		((pSourceFormat != nullptr) &&
+		 (*pSourceFormat != TIME_FORMAT_MEDIA_TIME))) {
+		return E_INVALIDARG;
+	}
+	*pTarget = Source;
+
+	return S_OK;
 }
 
 STDMETHODIMP CFFmpegDSFilter::SetPositions(
 	LONGLONG *pCurrent, DWORD dwCurrentFlags, LONGLONG *pStop,
 	DWORD dwStopFlags)
 {
-	LOGW("%s", __FUNCTION__);
-	return E_NOTIMPL;
+	CAutoLock lock(&m_csSeek);
+	HRESULT hr = S_OK;
+	LONGLONG start;
+	LONGLONG stop;
+	DWORD current_pos = dwCurrentFlags & AM_SEEKING_PositioningBitsMask;
+	DWORD stop_pos = dwStopFlags & AM_SEEKING_PositioningBitsMask;
+
+	GetSegment(&start, &stop);
+
+	switch (current_pos)
+	{
+	case AM_SEEKING_AbsolutePositioning:
+		start = *pCurrent;
+		break;
+	case AM_SEEKING_RelativePositioning:
+		GetCurrentPosition(&start);
+		start += *pCurrent;
+		break;
+	}
+	switch (stop_pos)
+	{
+	case AM_SEEKING_AbsolutePositioning:
+		stop = *pStop;
+		break;
+	case AM_SEEKING_RelativePositioning:
+		GetStopPosition(&stop);
+		stop += *pStop;
+		break;
+	}
+	if (start < 0) {
+		start = 0;
+	}
+
+	if (current_pos != AM_SEEKING_NoPositioning) {
+		hr = Seek(start, stop);
+	} else if (stop_pos != AM_SEEKING_NoPositioning) {
+		// only the stop position changed, no need to flush
+		CAutoLock lock(this);
+		m_rtStop = stop;
+	}
+
+	if (dwCurrentFlags & AM_SEEKING_ReturnTime) {
+		*pCurrent = start;
+	}
+	if (dwStopFlags & AM_SEEKING_ReturnTime) {
+		*pStop = stop;
+	}
+
+	return hr;
+}
+
+HRESULT CFFmpegDSFilter::Seek(LONGLONG start, LONGLONG stop)
+{
+	CFFmpegStreamOut *pins[] = { m_pVideoOut, m_pAudioOut };
+	bool streaming;
+	int64_t ts;
+	int ret;
+
+	{
+		CAutoLock lock(this);
+		streaming = (m_State != State_Stopped);
+	}
+
+	LOGD("%s: %lld - %lld", __FUNCTION__, start, stop);
+
+	if (streaming) {
+		// unblock the renderers first so that the pin threads can exit
+		for (CFFmpegStreamOut *pin : pins) {
+			if ((pin != nullptr) && pin->IsConnected()) {
+				pin->DeliverBeginFlush();
+			}
+		}
+		for (CFFmpegStreamOut *pin : pins) {
+			if (pin != nullptr) {
+				pin->StopThread();
+			}
+		}
+		StopDemux();
+	}
+
+	{
+		CAutoLock lock(this);
+
+		ts = av_rescale(start + m_rtStartTime, AV_TIME_BASE, 10000000);
+		ret = avformat_seek_file(
+			m_pAVFormatContext, -1, INT64_MIN, ts, ts, 0);
+		if (ret < 0) {
+			LOGE("avformat_seek_file() failed. (%d)", ret);
+		}
+		if (m_pVideoCodecContext != nullptr) {
+			avcodec_flush_buffers(m_pVideoCodecContext);
+		}
+		if (m_pAudioCodecContext != nullptr) {
+			avcodec_flush_buffers(m_pAudioCodecContext);
+		}
+		if (m_pSwrContext != nullptr) {
+			// drop the samples buffered for the old position
+			swr_init(m_pSwrContext);
+		}
+		m_rtStart = start;
+		m_rtStop = stop;
+	}
+
+	for (CFFmpegStreamOut *pin : pins) {
+		if (pin != nullptr) {
+			pin->SetPosition(start);
+		}
+	}
+
+	if (streaming) {
+		// each pin thread starts with NewSegment()
+		for (CFFmpegStreamOut *pin : pins) {
+			if ((pin != nullptr) && pin->IsConnected()) {
+				pin->DeliverEndFlush();
+				pin->StartThread();
+			}
+		}
+		StartDemux();
+	}
+
+	return (ret < 0)? E_FAIL:S_OK;
 }
 
 STDMETHODIMP CFFmpegDSFilter::GetPositions(
 	LONGLONG *pCurrent, LONGLONG *pStop)
 {
-	LOGW("%s", __FUNCTION__);
-	return E_NOTIMPL;
+	HRESULT hr;
+
+	if (pCurrent != nullptr) {
+		hr = GetCurrentPosition(pCurrent);
+		if (FAILED(hr)) {
+			return hr;
+		}
+	}
+	if (pStop != nullptr) {
+		hr = GetStopPosition(pStop);
+		if (FAILED(hr)) {
+			return hr;
+		}
+	}
+
+	return S_OK;
 }
 
 STDMETHODIMP CFFmpegDSFilter::GetAvailable(
@@ -488,13 +938,84 @@ STDMETHODIMP CFFmpegDSFilter::GetPreroll(LONGLONG *pllPreroll)
 	return S_OK;
 }
 
-DWORD CFFmpegDSFilter::ThreadProc(void)
+// av_read_frame() blocks on the source, so the demux keeps its own thread
+// even with the shared pool: a slow file must not hold a worker that the
+// decode tasks of the other graphs are waiting for.
+void CFFmpegDSFilter::StartDemux(void)
+{
+	if (!ThreadExists()) {
+		Create();
+	}
+}
+
+void CFFmpegDSFilter::StopDemux(void)
+{
+	if (ThreadExists()) {
+		CallWorker(THREAD_REQ_EXIT);
+		Close();
+	}
+}
+
+bool CFFmpegDSFilter::ReadPacket(AVPacket **packet, LONGLONG stop)
 {
 	int ret;
-	int video_stream = m_videoStreamIndex;
-	int audio_stream = m_audioStreamIndex;
 	AVFormatContext *fmt = m_pAVFormatContext;
+	AVPacket *pkt;
+	double time_base;
+
+	while (true) {
+		pkt = m_packetPool.Get();
+		ret = av_read_frame(fmt, pkt);
+		if (ret < 0) {
+			if (ret != AVERROR_EOF) {
+				LOGE("av_read_frame() failed. (%d)", ret);
+			}
+			m_packetPool.Put(&pkt);
+			return false;
+		}
+		if ((stop != MAX_TIME) && (pkt->pts != AV_NOPTS_VALUE)) {
+			time_base = 10000000 *
+				av_q2d(fmt->streams[pkt->stream_index]->time_base);
+			if (pkt->pts * time_base - m_rtStartTime > stop) {
+				m_packetPool.Put(&pkt);
+				return false;	// reached the stop position
+			}
+		}
+		if ((pkt->stream_index == m_indexStreamIndex) &&
+			(pkt->flags & AV_PKT_FLAG_KEY) &&
+			(pkt->dts != AV_NOPTS_VALUE) && (pkt->pos >= 0)) {
+			// libavformat's index is keyed by dts
+			m_keyframeIndex.Add(pkt->dts, pkt->pos);
+		}
+		// only indexed or ignored by the demuxer that does not support discard
+		if (fmt->streams[pkt->stream_index]->discard != AVDISCARD_DEFAULT) {
+			m_packetPool.Put(&pkt);
+			continue;
+		}
+		*packet = pkt;
+		return true;
+	}
+}
+
+CFFmpegStreamOut * CFFmpegDSFilter::GetStreamPin(int stream_index)
+{
+	if (stream_index == m_videoStreamIndex) {
+		return m_pVideoOut;
+	} else if (stream_index == m_audioStreamIndex) {
+		return m_pAudioOut;
+	} else {
+		return nullptr;
+	}
+}
+
+DWORD CFFmpegDSFilter::ThreadProc(void)
+{
+	CFFmpegStreamOut *pin;
 	AVPacket *packet = nullptr;
+	LONGLONG start;
+	LONGLONG stop;
+
+	GetSegment(&start, &stop);
 
 	while (true) {
 		if (CheckRequest(nullptr)) {
@@ -504,36 +1025,27 @@ DWORD CFFmpegDSFilter::ThreadProc(void)
 			}
 			Reply(S_OK);
 		}
-		packet = av_packet_alloc();
-		ret = av_read_frame(fmt, packet);
-		if (ret < 0) {
-			if (ret != AVERROR_EOF) {
-				LOGE("av_read_frame() failed. (%d)", ret);
-			}
+		if (!ReadPacket(&packet, stop)) {
 			break;
 		}
-		if (packet->stream_index == video_stream) {
-			m_pVideoOut->EnqueuePacket(packet);
-		} else if (packet->stream_index == audio_stream) {
-			m_pAudioOut->EnqueuePacket(packet);
+		pin = GetStreamPin(packet->stream_index);
+		if ((pin != nullptr) &&
+			pin->EnqueuePacket(packet, GetRequestHandle())) {
+			packet = nullptr;
 		}
-		packet = nullptr;
+		m_packetPool.Put(&packet);
 	}
 
 	if (m_pVideoOut != nullptr) {
-		m_pVideoOut->EnqueuePacket((AVPacket *)-1);
+		m_pVideoOut->EnqueueEndOfStream();
 		m_pVideoOut->WaitThread();
 	}
 	if (m_pAudioOut != nullptr) {
-		m_pAudioOut->EnqueuePacket((AVPacket *)-1);
+		m_pAudioOut->EnqueueEndOfStream();
 		m_pAudioOut->WaitThread();
 	}
 
 	Reply(S_OK);
 
-	if (packet != nullptr) {
-		av_packet_free(&packet);
-	}
-
 	return 0;
 }
@@ -7,9 +7,13 @@
 #undef __in
 #undef __out
 
+#include <mmreg.h>
+
 extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
+#include <libavutil/audio_fifo.h>
+#include <libavutil/imgutils.h>
 #include <libswscale/swscale.h>
 #include <libswresample/swresample.h>
 }
@@ -17,7 +21,101 @@ extern "C" {
 #define LOG_TAG "DSFilter"
 #include "common.h"
 
-#include <queue>
+#include <deque>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+#include "spscqueue.h"
+
+// per output pin; the demux thread blocks on a pin once any limit is reached
+#define PACKET_QUEUE_SIZE			1024
+#define PACKET_QUEUE_VIDEO_BYTES	(32 * 1024 * 1024)
+#define PACKET_QUEUE_AUDIO_BYTES	(2 * 1024 * 1024)
+#define PACKET_QUEUE_DURATION		(5 * 10000000LL)	// 5 sec
+
+// CPacketPool, the shells kept for reuse
+#define PACKET_POOL_SIZE			256
+
+// With the registry value "SharedPool" = 1 the decode stage runs as a task on
+// CExecutor instead of a thread per pin, and the video decoder defaults to 1
+// thread of its own.  The demux, which blocks on I/O, keeps its thread, and
+// so does the deliver stage of each pin, which scales and resamples into the
+// downstream buffers: a graph with audio and video still has 3 threads of
+// its own, against 5 plus the codec threads without the pool.
+// "SharedPoolThreads" sets the workers (0: one per CPU).  A task hands its
+// worker to the next graph after this many packets.
+#define EXECUTOR_MAX_THREADS		64
+#define DECODE_TASK_PACKETS			8
+
+// decoded frames waiting for conversion and delivery, per output pin
+#define FRAME_QUEUE_SIZE			4
+
+// requests kept in flight by CReadAhead
+#define READAHEAD_BLOCK_SIZE		0x10000
+#define READAHEAD_BLOCKS			8
+
+// CBlockCache, the budget can be overridden by the registry value
+// "BlockCacheBudget" (bytes, 0 to disable).  Only the reads after a seek fill
+// it, so that playback does not push out the pages that the seeks go back to.
+#define BLOCK_CACHE_PAGE_SIZE		0x10000
+#define BLOCK_CACHE_BUDGET			(4 * 1024 * 1024)
+
+// CFileMapping
+#define FILE_MAPPING_VIEW_SIZE		(64 * 1024 * 1024)
+
+// CKeyframeIndex, disabled by the registry value "KeyframeIndex" = 0
+#define KEY_INDEX_MAX_ENTRIES		(1024 * 1024)
+// a demuxer index whose last entry is short of this percentage of the
+// duration was built while reading and is completed from the cache
+#define KEY_INDEX_COVERAGE			90
+
+// files kept in each cache directory, the least recently used are deleted
+// beyond it; overridden by the registry value "CacheMaxFiles"
+#define CACHE_MAX_FILES				256
+// the file name of the cache entries, a 128-bit hash in hex
+#define CACHE_KEY_LENGTH			33
+
+// avformat_find_stream_info() reads at most this, overridden by the registry
+// values "ProbeSize" (bytes) and "AnalyzeDuration" (ms, 0: the libavformat
+// default).  Its results are kept by CProbeCache unless "ProbeCache" = 0.
+#define PROBE_SIZE					0x10000
+#define PROBE_CACHE_MAX_EXTRADATA	(1024 * 1024)
+
+// video decoder threads, overridden by the registry values "Threads"
+// (0: one per CPU) and "ThreadType" (FF_THREAD_FRAME | FF_THREAD_SLICE)
+#define DECODER_THREADS				0
+#define DECODER_THREAD_TYPE			(FF_THREAD_FRAME | FF_THREAD_SLICE)
+
+// CFFmpegAllocator, the count between the requested one and the maximum
+// follows the time the downstream holds the samples
+#define ALLOCATOR_MIN_BUFFERS		3
+#define ALLOCATOR_MAX_BUFFERS		16
+#define ALLOCATOR_ALIGN				64
+
+// audio is delivered in samples of this duration, overridden by the registry
+// value "AudioPacketMs" (1 - 1000)
+#define AUDIO_PACKET_MS				50
+// a decoded timestamp further than this from the sample count restarts the
+// audio clock
+#define AUDIO_RESYNC_THRESHOLD		(40 * 10000LL)		// 40 ms
+
+// renderer lateness at which the video decoder skips the non-reference
+// frames / everything but keyframes, it backs off at half of it
+#define QUALITY_SKIP_NONREF_LATE	(40 * 10000LL)		// 40 ms
+#define QUALITY_SKIP_NONKEY_LATE	(250 * 10000LL)		// 250 ms
+// a report older than this many frames is ignored, the renderer may stop
+// sending them once it has caught up
+#define QUALITY_REPORT_FRAMES		8
+// frame numbers kept for IAMDroppedFrames::GetDroppedInfo()
+#define QUALITY_DROPPED_INFO		64
+
+#define CONFIG_REG_KEY	"Software\\ffmpeg-w32codec\\dsfilter"
+
+// not in every uuids.h
+extern const FOURCCMap MEDIASUBTYPE_I420_;
+
+extern DWORD get_config_value(LPCSTR name, DWORD value);
 
 extern REFGUID get_video_subtype(AVCodecID codec_id);
 extern REFGUID get_audio_subtype(AVCodecID codec_id);
@@ -31,25 +129,217 @@ extern bool is_subtype_audio_out(REFGUID subtype);
 extern AVPixelFormat get_pixel_format(REFGUID subtype);
 
 extern REFGUID get_subtype_video_out(unsigned int index);
-extern REFGUID get_subtype_audio_out(unsigned int index);
+extern REFGUID get_subtype_audio_out(const WAVEFORMATEX *wfx);
 
 extern bool get_format_video_out(unsigned int index, VIDEOINFOHEADER *vih);
-extern bool get_format_audio_out(unsigned int index, WAVEFORMATEX *wfx);
+// index 0 is the packed variant of the decoder's format when it can be
+// output, WAVEFORMATEXTENSIBLE is used above 2 channels or 16 bits
+extern bool get_format_audio_out(
+	unsigned int index, AVSampleFormat native,
+	const AVChannelLayout *ch_layout, WAVEFORMATEXTENSIBLE *wfex);
+extern void get_channel_layout(
+	const WAVEFORMATEX *wfx, AVChannelLayout *ch_layout);
+
+// fills the plane pointers/strides of a sample of the given type and returns
+// its size; base, data and linesize may be nullptr to only get the size
+extern LONG get_video_planes(
+	const VIDEOINFOHEADER *vih, REFGUID subtype, BYTE *base,
+	uint8_t *data[4], int linesize[4]);
 
 extern WORD get_wave_format_tag(AVCodecID codec_id);
 
 extern AVSampleFormat get_sample_format(const WAVEFORMATEX *wfx);
 
+// planar float to interleaved s16, clipped; interleaved float is converted
+// as 1 channel of samples * channels
+extern void convert_fltp_to_s16(
+	int16_t *dst, const float * const *src, int channels, int samples);
+// planar float to interleaved float
+extern void convert_fltp_to_flt(
+	float *dst, const float * const *src, int channels, int samples);
+
 ///////////////////////////////////////////////////////////////////////////////
 
 class CFFmpegStreamIn;
 class CFFmpegStreamOut;
 
+// a hash of the size and both ends of the input, computed once per open
+extern bool get_cache_key(CFFmpegStreamIn *pStreamIn, WCHAR *key, size_t size);
+// a file under %LOCALAPPDATA%\ffmpeg-w32codec\<name> named after the key
+extern bool get_cache_path(
+	LPCWSTR key, LPCWSTR name, LPCWSTR ext, WCHAR *path, size_t size);
+// marks a cache file as used, trim_cache() deletes the least recent ones
+extern void touch_cache(LPCWSTR path);
+extern void trim_cache(LPCWSTR path);
+
+// Keyframe index (dts -> byte offset) of one stream, built while playing
+// and kept in %LOCALAPPDATA%\ffmpeg-w32codec\index for the next time.
+//
+// Used for the formats whose demuxer has no index of its own, or only the
+// one it builds while reading; the entries are handed to libavformat so
+// that its seek finds them.
+class CKeyframeIndex
+{
+public:
+	CKeyframeIndex();
+
+	// computes the cache file name and loads it if it exists
+	bool Open(LPCWSTR key, const AVStream *pAVStream);
+	void Save(void);
+	void Add(int64_t dts, int64_t pos);
+	void Apply(AVStream *pAVStream);
+
+	// true if the demuxer's own index reaches the end of the stream
+	static bool IsCovered(
+		const AVFormatContext *fmt, const AVStream *pAVStream);
+
+private:
+	typedef struct {
+		int64_t		dts;
+		int64_t		pos;
+	} entry_t;
+
+	void Load(void);
+
+	CCritSec				m_cs;
+	std::vector<entry_t>	m_entries;
+	bool					m_dirty;
+	AVRational				m_timeBase;
+	WCHAR					m_path[MAX_PATH];
+};
+
+// The stream parameters found by avformat_find_stream_info(), kept in
+// %LOCALAPPDATA%\ffmpeg-w32codec\probe so that the next open of the same
+// file can skip it.
+class CProbeCache
+{
+public:
+	CProbeCache();
+
+	// computes the cache file name
+	bool Open(LPCWSTR key);
+	// false unless an entry matching the demuxed streams was restored
+	bool Apply(AVFormatContext *fmt);
+	void Save(const AVFormatContext *fmt);
+
+private:
+	WCHAR		m_path[MAX_PATH];
+};
+
+// AVPacket shells taken by the demux thread and handed back by whichever
+// thread is done with them.  Both lists are interlocked SLists, so neither
+// side takes a lock or goes to the heap once the pool is warm.
+class CPacketPool
+{
+public:
+	CPacketPool();
+	~CPacketPool();
+
+	AVPacket * Get(void);
+	// unrefs the packet and keeps the shell, *packet is set to nullptr
+	void Put(AVPacket **packet);
+
+private:
+	typedef struct {
+		SLIST_ENTRY		entry;		// first, MEMORY_ALLOCATION_ALIGNMENT
+		AVPacket *		packet;
+	} node_t;
+
+	SLIST_HEADER			m_packets;	// nodes holding a shell
+	SLIST_HEADER			m_nodes;	// spare nodes
+	std::atomic<LONGLONG>	m_allocated;
+	std::atomic<LONGLONG>	m_recycled;
+	std::atomic<LONGLONG>	m_released;	// freed because the pool was full
+};
+
+enum {
+	TASK_YIELD,		// more to do, queued behind the other tasks
+	TASK_WAIT,		// idle until woken
+	TASK_DONE,		// WaitDone() returns, woken no more until Start()
+};
+
+// A unit of work of CExecutor.  Run() does a bounded slice of it and never
+// runs twice at a time; a Wake() during Run() makes it run once more, so a
+// task that returns TASK_WAIT misses no wake-up.
+class CTask
+{
+public:
+	CTask();
+	virtual ~CTask();
+
+	virtual int Run(void) = 0;
+
+	void Start(void);
+	void Wake(void);
+	void WaitDone(void);
+
+private:
+	friend class CExecutor;
+
+	std::atomic<int>	m_state;
+	HANDLE				m_hDone;	// manual-reset, set while done
+};
+
+template <class T>
+class CMemberTask : public CTask
+{
+public:
+	CMemberTask(T *pObject, int (T::*pfnRun)(void))
+		: m_pObject(pObject), m_pfnRun(pfnRun) {}
+
+	int Run(void) {
+		return (m_pObject->*m_pfnRun)();
+	}
+
+private:
+	T *			m_pObject;
+	int (T::*m_pfnRun)(void);
+};
+
+// Process-wide pool of workers shared by every filter instance.  A task woken
+// by a worker goes to that worker's own queue, the others steal from it once
+// theirs is empty; tasks woken from outside or yielding go to the shared
+// queue in order, which keeps the graphs taking turns.
+class CExecutor
+{
+public:
+	static CExecutor * GetInstance(void);
+
+private:
+	friend class CTask;
+
+	typedef struct {
+		CCritSec			cs;
+		std::deque<CTask *>	tasks;
+	} queue_t;
+
+	CExecutor();
+
+	static DWORD WINAPI WorkerProc(LPVOID pParam);
+	void Worker(int index);
+	void Push(CTask *task, bool yield);
+	CTask * Pop(int index, bool shared_first);
+	CTask * PopFront(queue_t *queue);
+	void Execute(CTask *task);
+
+	std::vector<queue_t *>	m_local;		// per worker
+	queue_t					m_shared;
+	HANDLE					m_hSemaphore;	// one count per queued task
+	volatile LONG			m_nextIndex;
+};
+
 enum {
 	THREAD_REQ_NONE,
 	THREAD_REQ_EXIT,
 };
 
+enum {
+	AUDIO_CONVERT_SWR,			// swresample
+	AUDIO_CONVERT_NONE,			// the decoded frames are the output format
+	AUDIO_CONVERT_FLT_S16,		// float to s16, same rate and layout
+	AUDIO_CONVERT_FLTP_FLT,		// planar to interleaved float
+};
+
 class DECLSPEC_UUID("b0eb2d5c-7474-4a05-9db4-3659f7081a27") CFFmpegDSFilter
 	: public CBaseFilter, public CCritSec, protected CAMThread, IMediaSeeking
 {
@@ -60,13 +350,54 @@ public:
 	virtual ~CFFmpegDSFilter();
 
 	HRESULT Init(void);
-	int Decode(AVFrame *frame, const AVPacket *packet);
-	size_t ConvertVideoFrame(
-		AVFrame *dst, const AVFrame *src, const VIDEOINFOHEADER *vih,
-		REFGUID fmt);
+	// packet is nullptr to drain, ReceiveFrame() then returns the frames
+	// left in the decoder until AVERROR_EOF
+	int SendPacket(int stream_index, const AVPacket *packet);
+	int ReceiveFrame(int stream_index, AVFrame *frame);
+	void FlushDecoder(int stream_index);
+	// only from the thread decoding the stream
+	void SetDecoderSkip(
+		int stream_index, AVDiscard skip_frame, AVDiscard skip_loop_filter);
+	// returns the bytes written to dst or -1
+	LONG ScaleVideoFrame(
+		BYTE *dst, LONG size, const AVFrame *src, const VIDEOINFOHEADER *vih,
+		REFGUID subtype);
+	// what the audio decoder outputs, offered first on the audio pin
+	AVSampleFormat GetAudioFormat(AVChannelLayout *ch_layout);
+	// chooses how the decoded audio becomes the negotiated PCM
+	void SetAudioOutput(const WAVEFORMATEX *wfx);
 	size_t ConvertAudioFrame(
 		AVFrame *dst, const AVFrame *src, const WAVEFORMATEX *wfx);
 
+	CPacketPool * GetPacketPool(void) {
+		return &m_packetPool;
+	}
+
+	// true if the decode stage runs on CExecutor
+	bool IsPooled(void) const {
+		return m_pooled;
+	}
+
+	// the time of the first sample of the file, the positions and sample
+	// times are relative to it
+	LONGLONG GetStartTime(void) const {
+		return m_rtStartTime;
+	}
+
+	void GetSegment(LONGLONG *pStart, LONGLONG *pStop) {
+		CAutoLock lock(this);
+		*pStart = m_rtStart;
+		*pStop = m_rtStop;
+	}
+
+	// only the streams of the connected output pins are demuxed, the others
+	// are discarded; pDisconnecting is the pin being disconnected, if any
+	void UpdateStreamDiscard(CFFmpegStreamOut *pDisconnecting);
+
+	// the pin whose IMediaSeeking calls are honored, the others are ignored
+	// since every renderer forwards the same request upstream
+	CFFmpegStreamOut * GetSeekingPin(void);
+
 	// CUnknown methods
 	DECLARE_IUNKNOWN;
 	STDMETHODIMP NonDelegatingQueryInterface(REFIID riid, void **ppv);
@@ -105,6 +436,17 @@ protected:
 	DWORD ThreadProc(void);
 
 private:
+	AVCodecContext * GetCodecContext(int stream_index);
+	HRESULT Seek(LONGLONG start, LONGLONG stop);
+	void StartDemux(void);
+	void StopDemux(void);
+	// the next packet of a connected stream, false at the end
+	bool ReadPacket(AVPacket **packet, LONGLONG stop);
+	CFFmpegStreamOut * GetStreamPin(int stream_index);
+	void SelectAudioConversion(
+		AVSampleFormat format, const AVChannelLayout *ch_layout,
+		int sample_rate, const WAVEFORMATEX *wfx);
+
 	CFFmpegStreamIn *	m_pStreamIn;
 	CFFmpegStreamOut *	m_pVideoOut;
 	CFFmpegStreamOut *	m_pAudioOut;
@@ -115,8 +457,24 @@ private:
 	AVCodecContext *	m_pAudioCodecContext;
 	SwsContext *		m_pSwsContext;
 	SwrContext *		m_pSwrContext;
+	int					m_audioConvert;
+	AVSampleFormat		m_audioSrcFormat;	// what m_audioConvert was chosen for
+	int					m_audioSrcChannels;
+	int					m_audioSrcRate;
 	int					m_videoStreamIndex;
 	int					m_audioStreamIndex;
+
+	CKeyframeIndex		m_keyframeIndex;
+	int					m_indexStreamIndex;	// -1 if not indexed
+
+	CPacketPool			m_packetPool;
+
+	bool				m_pooled;
+
+	CCritSec			m_csSeek;
+	LONGLONG			m_rtStartTime;
+	LONGLONG			m_rtStart;		// current segment
+	LONGLONG			m_rtStop;
 };
 
 #ifdef __CRT_UUID_DECL
@@ -127,6 +485,103 @@ __CRT_UUID_DECL(CFFmpegDSFilter,
 
 ///////////////////////////////////////////////////////////////////////////////
 
+// Sequential read-ahead through IAsyncReader::Request()/WaitForNext().
+//
+// Keeps up to READAHEAD_BLOCKS aligned requests in flight just after the
+// current read position.  A read outside of the window cancels all of them
+// and restarts there.
+class CReadAhead
+{
+public:
+	CReadAhead(IAsyncReader *pReader, HRESULT *phr);
+	~CReadAhead();
+
+	// returns the number of bytes read, 0 at the end of file or -1 on error
+	LONG Read(LONGLONG offset, BYTE *buf, LONG size);
+
+private:
+	typedef struct {
+		IMediaSample *	pSample;
+		LONGLONG		start;
+		LONG			length;
+		bool			pending;
+	} block_t;
+
+	block_t * Find(LONGLONG pos);
+	HRESULT Issue(block_t *block);
+	HRESULT WaitFor(block_t *block);
+	void Cancel(void);
+	HRESULT Restart(LONGLONG pos);
+
+	IAsyncReader *		m_pReader;
+	IMemAllocator *		m_pAllocator;
+	LONG				m_blockSize;
+	LONG				m_blockCount;
+	LONG				m_align;
+	LONGLONG			m_total;
+	LONGLONG			m_next;
+	block_t				m_blocks[READAHEAD_BLOCKS];
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Read-only mapping of a local file, used instead of the upstream reader
+// when the source is the File Source (Async.) filter.
+class CFileMapping
+{
+public:
+	CFileMapping(LPCWSTR path, HRESULT *phr);
+	~CFileMapping();
+
+	// returns the number of bytes read, 0 at the end of file or -1 on error
+	LONG Read(LONGLONG offset, BYTE *buf, LONG size);
+
+private:
+	bool Map(LONGLONG pos);
+
+	HANDLE				m_hFile;
+	HANDLE				m_hMapping;
+	BYTE *				m_pView;
+	LONGLONG			m_viewOffset;
+	size_t				m_viewSize;
+	LONGLONG			m_length;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+// LRU cache of BLOCK_CACHE_PAGE_SIZE aligned pages of the input stream.
+//
+// The demuxers jump between the header, the index and the data while
+// opening and seeking; this keeps those regions from being read twice.
+class CBlockCache
+{
+public:
+	typedef struct {
+		LONGLONG	index;		// offset / BLOCK_CACHE_PAGE_SIZE
+		LONG		length;		// shorter than a page only at the end
+		BYTE		data[BLOCK_CACHE_PAGE_SIZE];
+	} page_t;
+
+	CBlockCache(size_t budget);
+	~CBlockCache();
+
+	page_t * Find(LONGLONG index);
+	// returns an empty page, recycling the least recently used one if the
+	// budget is exhausted
+	page_t * Insert(LONGLONG index);
+	void Remove(page_t *page);
+
+private:
+	size_t			m_budget;
+	size_t			m_used;
+	ULONGLONG		m_hits;
+	ULONGLONG		m_misses;
+	std::list<page_t *>	m_lru;
+	std::unordered_map<LONGLONG, std::list<page_t *>::iterator>	m_map;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
 class CFFmpegStreamIn : public CBaseInputPin, public CCritSec
 {
 public:
@@ -146,17 +601,109 @@ public:
 	HRESULT CheckMediaType(const CMediaType *pMediaType);
 	HRESULT CheckConnect(IPin *pPin);
 	HRESULT CompleteConnect(IPin *pReceivePin);
+	HRESULT BreakConnect(void);
+
+	bool IsFileMapped(void) const {
+		return m_pFileMapping != nullptr;
+	}
+
+	// random access for the filter, bypasses the AVIO position
+	LONG ReadAt(LONGLONG offset, BYTE *buf, LONG size);
+	LONGLONG GetLength(void);
 
 private:
+	LONG ReadUpstream(LONGLONG offset, BYTE *buf, LONG size);
+	// the pages that are not cached are read past the cache unless fill
+	LONG ReadCached(LONGLONG offset, BYTE *buf, LONG size, bool fill);
+
 	int64_t				m_offset;
+	int64_t				m_readEnd;	// where the last Read() stopped, -1: none
 	IAsyncReader *		m_pAsyncReader;
+	CReadAhead *		m_pReadAhead;
+	CBlockCache *		m_pBlockCache;
+	CFileMapping *		m_pFileMapping;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+class CFFmpegMediaSample : public CMediaSample
+{
+	friend class CFFmpegAllocator;
+
+public:
+	CFFmpegMediaSample(
+		CBaseAllocator *pAllocator, HRESULT *phr, LONG size, LONG prefix,
+		LONG align);
+	virtual ~CFFmpegMediaSample();
+
+private:
+	BYTE *		m_pBase;
+	LONGLONG	m_acquired;		// QPC ticks of GetBuffer()
+};
+
+typedef struct {
+	LONGLONG	requests;
+	LONGLONG	waits;			// GetBuffer() calls that found no free sample
+	LONGLONG	waitUs;
+	LONGLONG	maxWaitUs;
+	LONGLONG	holdUs;			// average time a sample is held
+	LONGLONG	buffers;
+	LONGLONG	peakBuffers;
+	LONGLONG	grown;
+	LONGLONG	shrunk;
+} allocator_stats_t;
+
+// Output allocator with per-sample aligned buffers.
+//
+// A sample is added instead of waiting when the free list is empty and the
+// pool is below the count needed for the observed hold time, and dropped on
+// release when the pool is above it.
+class CFFmpegAllocator : public CBaseAllocator
+{
+public:
+	CFFmpegAllocator(LPCTSTR pName, LPUNKNOWN pUnk, HRESULT *phr);
+	virtual ~CFFmpegAllocator();
+
+	void GetStats(allocator_stats_t *stats);
+
+	// IMemAllocator methods
+	STDMETHODIMP SetProperties(
+		ALLOCATOR_PROPERTIES *pRequest, ALLOCATOR_PROPERTIES *pActual);
+	STDMETHODIMP GetBuffer(
+		IMediaSample **ppBuffer, REFERENCE_TIME *pStartTime,
+		REFERENCE_TIME *pEndTime, DWORD dwFlags);
+	STDMETHODIMP ReleaseBuffer(IMediaSample *pBuffer);
+
+protected:
+	// CBaseAllocator methods
+	HRESULT Alloc(void);
+	void Free(void);
+
+private:
+	void ReallyFree(void);
+	CMediaSample * NewSample(void);
+	LONG GetDesiredCount(void) const;
+
+	LONG				m_lMinCount;
+	LONG				m_lMaxCount;
+	LONGLONG			m_frequency;
+	LONGLONG			m_lastRequest;
+	LONGLONG			m_interval;		// QPC ticks between GetBuffer() calls
+	LONGLONG			m_hold;			// QPC ticks a sample is held
+	allocator_stats_t	m_stats;
 };
 
 ///////////////////////////////////////////////////////////////////////////////
 
+typedef struct {
+	LONGLONG	packets;		// high-water marks
+	LONGLONG	bytes;
+	LONGLONG	duration;		// 100 ns units
+} queue_stats_t;
+
 class CFFmpegStreamOut
 	: public CBaseOutputPin, public CCritSec, protected CAMThread,
-	  IMediaSeeking
+	  IMediaSeeking, IAMDroppedFrames
 {
 public:
 	CFFmpegStreamOut(
@@ -165,18 +712,42 @@ public:
 		const AVStream *pAVStream, const AVCodec *pAVCodec);
 	virtual ~CFFmpegStreamOut();
 
-	void EnqueuePacket(AVPacket *packet) {
-		if (WAIT_OBJECT_0 == WaitForSingleObject(m_hEvent, INFINITE)) {
-			CAutoLock lock(this);
-			m_packetQueue.push(packet);
-			if (m_packetQueue.size() >= 256) {
-				ResetEvent(m_hEvent);
-			}
+	// blocks while the queue is over budget, returns false if hAbort is
+	// signaled
+	bool EnqueuePacket(AVPacket *packet, HANDLE hAbort);
+
+	void EnqueueEndOfStream(void) {
+		m_packetQueue.SetEndOfStream();
+		if (m_pooled) {
+			m_decodeTask.Wake();
 		}
 	}
 
 	void WaitThread(void) {
-		WaitForSingleObject(m_hThread, INFINITE);
+		// the decode task has no thread to wait for
+		if (!m_pooled) {
+			WaitForSingleObject(m_hThread, INFINITE);
+		}
+	}
+
+	void GetQueueStats(queue_stats_t *stats) const {
+		*stats = m_queueStats;
+	}
+
+	// returns false if the downstream allocator is in use
+	bool GetAllocatorStats(allocator_stats_t *stats);
+
+	// starts/stops the decode and deliver threads, packets left in the queue
+	// are freed
+	void StartThread(void);
+	void StopThread(void);
+
+	// stream time of the last delivered sample
+	LONGLONG GetPosition(void) const {
+		return m_rtPosition.load();
+	}
+	void SetPosition(LONGLONG position) {
+		m_rtPosition = position;
 	}
 
 	// CUnknown methods
@@ -186,6 +757,10 @@ public:
 	// CBaseOutputPin methods
 	HRESULT CheckConnect(IPin *pPin);
 	HRESULT CheckMediaType(const CMediaType *pMediaType);
+	HRESULT CompleteConnect(IPin *pReceivePin);
+	HRESULT BreakConnect(void);
+	HRESULT DecideAllocator(IMemInputPin *pPin, IMemAllocator **ppAlloc);
+	HRESULT InitAllocator(IMemAllocator **ppAlloc);
 	HRESULT DecideBufferSize(
 		IMemAllocator *pAllocator, ALLOCATOR_PROPERTIES *pProperties);
 	HRESULT GetMediaType(int iPosition, CMediaType *pMediaType);
@@ -193,9 +768,14 @@ public:
 	HRESULT Inactive(void);
 
 	// IQualityControl methods
-	STDMETHODIMP Notify(IBaseFilter *pSender, Quality q) {
-		return E_NOTIMPL;
-	}
+	STDMETHODIMP Notify(IBaseFilter *pSender, Quality q);
+
+	// IAMDroppedFrames methods
+	STDMETHODIMP GetNumDropped(long *plDropped);
+	STDMETHODIMP GetNumNotDropped(long *plNotDropped);
+	STDMETHODIMP GetDroppedInfo(
+		long lSize, long *plArray, long *plNumCopied);
+	STDMETHODIMP GetAverageFrameSize(long *plAverageSize);
 
 	// IMediaSeeking methods
 	STDMETHODIMP GetCapabilities(DWORD *pCapabilities);
@@ -224,25 +804,100 @@ protected:
 	DWORD ThreadProc(void);
 
 private:
-	AVPacket * DequeuePacket(void) {
-		CAutoLock lock(this);
-		AVPacket *packet;
-		if (m_packetQueue.empty()) {
-			return nullptr;
-		}
-		packet = m_packetQueue.front();
-		m_packetQueue.pop();
-		SetEvent(m_hEvent);
-		return packet;
+	bool IsQueueFull(void) const {
+		return (m_packetQueue.Size() > 0) &&
+			((m_queuedBytes.load() >= m_maxQueuedBytes) ||
+			 (m_queuedDuration.load() >= PACKET_QUEUE_DURATION));
 	}
 
-	size_t Convert(AVFrame *dst, const AVFrame *src);
-	HRESULT Prepare(
-		IMediaSample *pSample, const AVFrame *frame, size_t size,
-		size_t *offset);
+	bool DequeuePacket(AVPacket **packet, HANDLE hWake);
+	void UpdateQueueStats(LONGLONG bytes, LONGLONG duration);
+	// frees what is left in the packet and frame queues
+	void ReleaseQueues(void);
+	LONGLONG GetPacketDuration(const AVPacket *packet) const {
+		return (LONGLONG)(packet->duration * m_timeBase);
+	}
+	// a stream timestamp on the timeline of IMediaSeeking
+	REFERENCE_TIME ToReferenceTime(int64_t ts) const {
+		return (REFERENCE_TIME)(ts * m_timeBase) - m_rtStartTime;
+	}
 
-	std::queue<AVPacket *>	m_packetQueue;
-	HANDLE					m_hEvent;
+	// receives every frame of the last packet into the frame queue, S_FALSE
+	// if the deliver thread has exited
+	HRESULT DecodeFrames(int *frames);
+	// the deliver thread converts and delivers the queued frames while the
+	// decode thread (ThreadProc) works on the next ones
+	static DWORD WINAPI DeliverThreadProc(LPVOID pParam);
+	// the decode stage as a task of CExecutor, the same steps as ThreadProc
+	// without blocking
+	int RunDecode(void);
+	void FinishDecode(bool eos);
+	HRESULT DeliverLoop(void);
+	HRESULT DeliverFrame(const AVFrame *frame, AVFrame *frame_cvt);
+	// turns the lateness last reported by the renderer into skip levels
+	void UpdateDecoderSkip(void);
+	// the lateness of the last report, 0 once it is stale
+	LONGLONG GetQualityLate(void);
+	bool IsTooLate(REFERENCE_TIME rt_start);
+	// counts the frames the decoder has held beyond its own delay as dropped
+	void CountSkipped(void);
+	void CountDropped(void);
+	HRESULT DeliverVideoFrame(const AVFrame *frame);
+	size_t Convert(AVFrame *dst, const AVFrame *src);
+	LONG GetAudioPacketSamples(void) const;
+	REFERENCE_TIME SamplesToTime(LONGLONG samples) const {
+		return av_rescale(samples, 10000000,
+			((WAVEFORMATEX *)m_mt.pbFormat)->nSamplesPerSec);
+	}
+	// writes the frame to the FIFO and delivers every full packet
+	HRESULT QueueAudioFrame(const AVFrame *frame);
+	HRESULT DeliverAudioPacket(int samples);
+	// the times are stream time, rt_start is AV_NOPTS_VALUE if unknown
+	HRESULT SetSampleProperties(
+		IMediaSample *pSample, bool sync_point, bool corrupt,
+		REFERENCE_TIME rt_start, REFERENCE_TIME rt_end);
+
+	CSPSCQueue<AVPacket *>	m_packetQueue;
+	std::atomic<LONGLONG>	m_queuedBytes;
+	std::atomic<LONGLONG>	m_queuedDuration;
+	LONGLONG				m_maxQueuedBytes;
+	queue_stats_t			m_queueStats;
+	CSPSCQueue<AVFrame *>	m_frameQueue;
+	HANDLE					m_hDeliverThread;
+	HANDLE					m_hDeliverStop;		// manual-reset
+	HRESULT					m_deliverResult;	// once the thread exits
+	bool					m_pooled;
+	CMemberTask<CFFmpegStreamOut>	m_decodeTask;
+	std::atomic<bool>		m_decodeExit;
+	AVFrame *				m_pPendingFrame;	// received, not queued yet
+	bool					m_decodeSent;		// a packet since the frames
+	bool					m_decodeDraining;
+	LONGLONG				m_packetsSent;		// since the last flush
+	LONGLONG				m_framesReceived;
+	LONGLONG				m_framesSkipped;
+	LONGLONG				m_decoderDelay;		// most frames held unskipped
+	LONGLONG				m_rtSegmentStart;
+	bool					m_discontinuity;
+	std::atomic<LONGLONG>	m_rtPosition;
+	int						m_streamIndex;
 	double					m_timeBase;
+	LONGLONG				m_rtStartTime;
 	LONGLONG				m_preroll;
+	AVAudioFifo *			m_pAudioFifo;
+	int						m_audioPacketSamples;
+	bool					m_audioAnchored;
+	REFERENCE_TIME			m_rtAudioAnchor;	// time of the sample count 0
+	LONGLONG				m_audioSamples;		// delivered since the anchor
+	CFFmpegAllocator *		m_pPoolAllocator;	// last one created, AddRef'ed
+
+	std::atomic<LONGLONG>	m_qualityLate;		// from Notify()
+	std::atomic<LONGLONG>	m_qualityStamp;
+	int						m_skipLevel;
+	CCritSec				m_csDropped;
+	long					m_qualityFrame;		// m_frameNumber at the report
+	long					m_framesDropped;
+	long					m_framesDelivered;
+	LONGLONG				m_bytesDelivered;
+	long					m_frameNumber;		// since the last start
+	std::vector<long>		m_droppedInfo;		// ring of frame numbers
 };
@@ -0,0 +1,245 @@
+// Copyright (c) 2024 Takahiro Ishida
+// Licensed under the MIT License.
+
+#include "dsfilter.h"
+
+// the shared queue is looked at first once in this many pops, so that the
+// tasks a worker keeps waking do not starve the yielded ones
+#define EXECUTOR_SHARED_INTERVAL	61
+
+enum {
+	TASK_STATE_IDLE,
+	TASK_STATE_QUEUED,
+	TASK_STATE_RUNNING,
+	TASK_STATE_WOKEN,		// running, and woken meanwhile
+	TASK_STATE_DONE,
+};
+
+// index of the worker running on this thread, -1 elsewhere
+static thread_local int t_workerIndex = -1;
+
+CTask::CTask()
+	: m_state(TASK_STATE_DONE)
+{
+	m_hDone = CreateEvent(nullptr, TRUE, TRUE, nullptr);
+}
+
+CTask::~CTask()
+{
+	if (m_hDone != nullptr) {
+		CloseHandle(m_hDone);
+	}
+}
+
+void CTask::Start(void)
+{
+	ResetEvent(m_hDone);
+	m_state.store(TASK_STATE_IDLE);
+	Wake();
+}
+
+void CTask::Wake(void)
+{
+	int state = m_state.load();
+
+	while (true) {
+		switch (state)
+		{
+		case TASK_STATE_IDLE:
+			if (m_state.compare_exchange_weak(state, TASK_STATE_QUEUED)) {
+				CExecutor::GetInstance()->Push(this, false);
+				return;
+			}
+			break;
+
+		case TASK_STATE_RUNNING:
+			if (m_state.compare_exchange_weak(state, TASK_STATE_WOKEN)) {
+				return;
+			}
+			break;
+
+		default:
+			// queued or woken already, or done
+			return;
+		}
+	}
+}
+
+void CTask::WaitDone(void)
+{
+	WaitForSingleObject(m_hDone, INFINITE);
+}
+
+CExecutor * CExecutor::GetInstance(void)
+{
+	// never freed, the workers live as long as the process
+	static CExecutor *instance = new CExecutor();
+
+	return instance;
+}
+
+CExecutor::CExecutor()
+	: m_nextIndex(0)
+{
+	HMODULE hModule;
+	HANDLE hThread;
+	SYSTEM_INFO si;
+	DWORD threads = get_config_value("SharedPoolThreads", 0);
+
+	if (threads == 0) {
+		GetSystemInfo(&si);
+		threads = si.dwNumberOfProcessors;
+	}
+	threads = min(max(threads, (DWORD)1), (DWORD)EXECUTOR_MAX_THREADS);
+
+	// FreeLibrary() must not unmap the code the workers are waiting in
+	GetModuleHandleExW(
+		GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_PIN,
+		(LPCWSTR)CExecutor::WorkerProc, &hModule);
+
+	m_hSemaphore = CreateSemaphore(nullptr, 0, MAXLONG, nullptr);
+	for (DWORD i=0; i<threads; i++) {
+		m_local.push_back(new queue_t);
+	}
+	for (DWORD i=0; i<threads; i++) {
+		hThread = CreateThread(nullptr, 0, WorkerProc, this, 0, nullptr);
+		if (hThread == nullptr) {
+			LOGE("CreateThread() failed. (%lu)", GetLastError());
+			continue;
+		}
+		CloseHandle(hThread);
+	}
+
+	LOGI("executor: %lu workers", threads);
+}
+
+DWORD WINAPI CExecutor::WorkerProc(LPVOID pParam)
+{
+	CExecutor *executor = static_cast<CExecutor *>(pParam);
+
+	executor->Worker(InterlockedIncrement(&executor->m_nextIndex) - 1);
+
+	return 0;
+}
+
+void CExecutor::Worker(int index)
+{
+	CTask *task;
+	unsigned int tick = 0;
+
+	t_workerIndex = index;
+
+	while (true) {
+		WaitForSingleObject(m_hSemaphore, INFINITE);
+
+		// every count stands for a queued task, but another worker may be
+		// taking the one this one is looking at
+		while (true) {
+			task = Pop(index, (++tick % EXECUTOR_SHARED_INTERVAL) == 0);
+			if (task != nullptr) {
+				break;
+			}
+			SwitchToThread();
+		}
+		Execute(task);
+	}
+}
+
+void CExecutor::Push(CTask *task, bool yield)
+{
+	queue_t *queue = &m_shared;
+
+	// a task woken by a worker most likely works on what that worker has
+	// just touched
+	if (!yield && (t_workerIndex >= 0)) {
+		queue = m_local[t_workerIndex];
+	}
+
+	{
+		CAutoLock lock(&queue->cs);
+		queue->tasks.push_back(task);
+	}
+	ReleaseSemaphore(m_hSemaphore, 1, nullptr);
+}
+
+CTask * CExecutor::Pop(int index, bool shared_first)
+{
+	CTask *task;
+	queue_t *queue;
+	size_t n = m_local.size();
+
+	if (shared_first && ((task = PopFront(&m_shared)) != nullptr)) {
+		return task;
+	}
+
+	// the newest of its own first, it is still in the cache
+	{
+		queue = m_local[index];
+		CAutoLock lock(&queue->cs);
+		if (!queue->tasks.empty()) {
+			task = queue->tasks.back();
+			queue->tasks.pop_back();
+			return task;
+		}
+	}
+
+	if ((task = PopFront(&m_shared)) != nullptr) {
+		return task;
+	}
+
+	// steal the oldest of the others
+	for (size_t i=1; i<n; i++) {
+		if ((task = PopFront(m_local[(index + i) % n])) != nullptr) {
+			return task;
+		}
+	}
+
+	return nullptr;
+}
+
+CTask * CExecutor::PopFront(queue_t *queue)
+{
+	CAutoLock lock(&queue->cs);
+	CTask *task;
+
+	if (queue->tasks.empty()) {
+		return nullptr;
+	}
+	task = queue->tasks.front();
+	queue->tasks.pop_front();
+
+	return task;
+}
+
+void CExecutor::Execute(CTask *task)
+{
+	int state;
+	HANDLE hDone;
+
+	task->m_state.store(TASK_STATE_RUNNING);
+
+	switch (task->Run())
+	{
+	case TASK_DONE:
+		hDone = task->m_hDone;
+		task->m_state.store(TASK_STATE_DONE);
+		// the task may be freed as soon as this is set
+		SetEvent(hDone);
+		return;
+
+	case TASK_WAIT:
+		state = TASK_STATE_RUNNING;
+		if (task->m_state.compare_exchange_strong(state, TASK_STATE_IDLE)) {
+			return;
+		}
+		// woken while running
+		break;
+
+	default:
+		break;
+	}
+
+	// behind everything queued so far, so that each graph gets its turn
+	task->m_state.store(TASK_STATE_QUEUED);
+	Push(task, true);
+}
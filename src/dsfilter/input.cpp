@@ -3,17 +3,61 @@
 
 #include "dsfilter.h"
 
+static CFileMapping *open_file_mapping(IPin *pPin)
+{
+	HRESULT hr;
+	PIN_INFO info;
+	IFileSourceFilter *pFileSource;
+	LPOLESTR path = nullptr;
+	CFileMapping *mapping = nullptr;
+
+	hr = pPin->QueryPinInfo(&info);
+	if (FAILED(hr)) {
+		return nullptr;
+	}
+	hr = info.pFilter->QueryInterface(&pFileSource);
+	info.pFilter->Release();
+	if (FAILED(hr)) {
+		return nullptr;
+	}
+
+	hr = pFileSource->GetCurFile(&path, nullptr);
+	pFileSource->Release();
+	if (FAILED(hr) || (path == nullptr)) {
+		return nullptr;
+	}
+
+	mapping = new CFileMapping(path, &hr);
+	if (FAILED(hr)) {
+		delete mapping;
+		mapping = nullptr;
+	}
+	CoTaskMemFree(path);
+
+	return mapping;
+}
+
 CFFmpegStreamIn::CFFmpegStreamIn(
 	LPCTSTR pObjectName, CFFmpegDSFilter *pFilter, CCritSec *pLock,
 	HRESULT *phr)
 	: CBaseInputPin(pObjectName, pFilter, pLock, phr, L"FFmpeg Stream In"),
-	m_offset(0), m_pAsyncReader(nullptr)
+	m_offset(0), m_readEnd(-1), m_pAsyncReader(nullptr),
+	m_pReadAhead(nullptr), m_pBlockCache(nullptr), m_pFileMapping(nullptr)
 {
 	*phr = S_OK;
 }
 
 CFFmpegStreamIn::~CFFmpegStreamIn()
 {
+	if (m_pBlockCache != nullptr) {
+		delete m_pBlockCache;
+	}
+	if (m_pFileMapping != nullptr) {
+		delete m_pFileMapping;
+	}
+	if (m_pReadAhead != nullptr) {
+		delete m_pReadAhead;
+	}
 	if (m_pAsyncReader != nullptr) {
 		m_pAsyncReader->Release();
 	}
@@ -87,6 +131,7 @@ HRESULT CFFmpegStreamIn::CheckConnect(IPin *pPin)
 HRESULT CFFmpegStreamIn::CompleteConnect(IPin *pReceivePin)
 {
 	HRESULT hr;
+	DWORD budget;
 
 	hr = CBaseInputPin::CompleteConnect(pReceivePin);
 	if (FAILED(hr)) {
@@ -100,38 +145,188 @@ HRESULT CFFmpegStreamIn::CompleteConnect(IPin *pReceivePin)
 		return hr;
 	}
 
+	// a local file is read from its mapping, neither read-ahead nor the
+	// block cache is needed then
+	m_pFileMapping = open_file_mapping(pReceivePin);
+	if (m_pFileMapping != nullptr) {
+		return static_cast<CFFmpegDSFilter *>(m_pFilter)->Init();
+	}
+
+	m_pReadAhead = new CReadAhead(m_pAsyncReader, &hr);
+	if (FAILED(hr)) {
+		LOGW("read-ahead is not available, fall back to SyncRead().");
+		delete m_pReadAhead;
+		m_pReadAhead = nullptr;
+	}
+
+	budget = get_config_value("BlockCacheBudget", BLOCK_CACHE_BUDGET);
+	if ((budget > 0) && (m_pBlockCache == nullptr)) {
+		m_pBlockCache = new CBlockCache(budget);
+	}
+
 	return static_cast<CFFmpegDSFilter *>(m_pFilter)->Init();
 }
 
+HRESULT CFFmpegStreamIn::BreakConnect(void)
+{
+	CAutoLock lock(this);
+
+	// the next connection may be to another reader, nothing of this one
+	// may be left behind
+	if (m_pFileMapping != nullptr) {
+		delete m_pFileMapping;
+		m_pFileMapping = nullptr;
+	}
+	if (m_pBlockCache != nullptr) {
+		delete m_pBlockCache;
+		m_pBlockCache = nullptr;
+	}
+	if (m_pReadAhead != nullptr) {
+		delete m_pReadAhead;
+		m_pReadAhead = nullptr;
+	}
+	if (m_pAsyncReader != nullptr) {
+		m_pAsyncReader->Release();
+		m_pAsyncReader = nullptr;
+	}
+	m_offset = 0;
+	m_readEnd = -1;
+
+	return CBaseInputPin::BreakConnect();
+}
+
 int CFFmpegStreamIn::Read(void *opaque, uint8_t *buf, int buf_size)
 {
 	CFFmpegStreamIn *pin = static_cast<CFFmpegStreamIn *>(opaque);
 	CAutoLock lock(pin);
+	LONG ret;
+
+	if (pin->m_pBlockCache != nullptr) {
+		// streaming goes through the read-ahead, not through the cache
+		ret = pin->ReadCached(pin->m_offset, buf, buf_size,
+			pin->m_offset != pin->m_readEnd);
+	} else {
+		ret = pin->ReadUpstream(pin->m_offset, buf, buf_size);
+	}
+	if (ret <= 0) {
+		return AVERROR_EOF;
+	}
+
+	pin->m_offset += ret;
+	pin->m_readEnd = pin->m_offset;
+
+	return ret;
+}
+
+LONG CFFmpegStreamIn::ReadAt(LONGLONG offset, BYTE *buf, LONG size)
+{
+	CAutoLock lock(this);
+
+	if (m_pBlockCache != nullptr) {
+		return ReadCached(offset, buf, size, true);
+	}
+	return ReadUpstream(offset, buf, size);
+}
+
+LONGLONG CFFmpegStreamIn::GetLength(void)
+{
 	HRESULT hr;
 	LONGLONG total;
 	LONGLONG avail;
 
-	hr = pin->m_pAsyncReader->SyncRead(pin->m_offset, buf_size, buf);
+	hr = m_pAsyncReader->Length(&total, &avail);
+	if (FAILED(hr)) {
+		LOGE("IAsyncReader::Length() failed.");
+		return -1;
+	}
+
+	return total;
+}
+
+LONG CFFmpegStreamIn::ReadUpstream(LONGLONG offset, BYTE *buf, LONG size)
+{
+	HRESULT hr;
+	LONGLONG total;
+	LONGLONG avail;
+	LONG ret;
+
+	if (m_pFileMapping != nullptr) {
+		ret = m_pFileMapping->Read(offset, buf, size);
+		if (ret < 0) {
+			LOGE("CFileMapping::Read() failed.");
+		}
+		return ret;
+	}
+
+	if (m_pReadAhead != nullptr) {
+		ret = m_pReadAhead->Read(offset, buf, size);
+		if (ret < 0) {
+			LOGE("CReadAhead::Read() failed.");
+		}
+		return ret;
+	}
+
+	hr = m_pAsyncReader->SyncRead(offset, size, buf);
 	if (FAILED(hr)) {
 		LOGE("IAsyncReader::SyncRead() failed. (0x%08x)", hr);
-		return AVERROR_EOF;
+		return -1;
 	}
 
 	if (hr == S_FALSE) {
-		hr = pin->m_pAsyncReader->Length(&total, &avail);
+		hr = m_pAsyncReader->Length(&total, &avail);
 		if (FAILED(hr)) {
 			LOGE("IAsyncReader::Length() failed.");
-			return AVERROR_EOF;
-		}
-		buf_size = total - pin->m_offset;
-		if (buf_size == 0) {
-			return AVERROR_EOF;
+			return -1;
 		}
+		size = (LONG)max(total - offset, 0LL);
 	}
 
-	pin->m_offset += buf_size;
+	return size;
+}
+
+LONG CFFmpegStreamIn::ReadCached(
+	LONGLONG offset, BYTE *buf, LONG size, bool fill)
+{
+	CBlockCache::page_t *page;
+	LONGLONG index;
+	LONG done = 0;
+	LONG pos;
+	LONG n;
+
+	while (done < size) {
+		index = (offset + done) / BLOCK_CACHE_PAGE_SIZE;
+		pos = (LONG)((offset + done) % BLOCK_CACHE_PAGE_SIZE);
+
+		page = m_pBlockCache->Find(index);
+		if ((page == nullptr) && !fill) {
+			n = ReadUpstream(offset + done, buf + done, size - done);
+			if (n < 0) {
+				return (done > 0)? done:-1;
+			}
+			done += n;
+			break;
+		}
+		if (page == nullptr) {
+			page = m_pBlockCache->Insert(index);
+			n = ReadUpstream(
+				index * BLOCK_CACHE_PAGE_SIZE, page->data,
+				BLOCK_CACHE_PAGE_SIZE);
+			if (n < 0) {
+				m_pBlockCache->Remove(page);
+				return (done > 0)? done:-1;
+			}
+			page->length = n;
+		}
+
+		if (pos >= page->length) {
+			break;	// end of file
+		}
+		n = min(page->length - pos, size - done);
+		CopyMemory(buf + done, page->data + pos, n);
+		done += n;
+	}
 
-	return buf_size;
+	return done;
 }
 
 int64_t CFFmpegStreamIn::Seek(void *opaque, int64_t offset, int whence)
@@ -0,0 +1,331 @@
+// Copyright (c) 2024 Takahiro Ishida
+// Licensed under the MIT License.
+
+#include "dsfilter.h"
+
+#include <algorithm>
+
+extern "C" {
+#include <libavutil/murmur3.h>
+}
+
+#define KEY_INDEX_MAGIC		0x494b5746	// "FWKI"
+#define KEY_INDEX_VERSION	2			// 1 was keyed by pts
+#define CACHE_KEY_SAMPLE	0x10000		// bytes hashed at each end
+
+typedef struct {
+	DWORD		magic;
+	DWORD		version;
+	int32_t		time_base_num;
+	int32_t		time_base_den;
+	DWORD		count;
+	DWORD		reserved;
+} key_index_header_t;
+
+bool get_cache_key(CFFmpegStreamIn *pStreamIn, WCHAR *key, size_t size)
+{
+	BYTE *buf;
+	LONGLONG length;
+	LONG n;
+	uint8_t hash[16];
+	AVMurMur3 *ctx;
+
+	// the size and both ends of the file
+	length = pStreamIn->GetLength();
+	if (length <= 0) {
+		return false;
+	}
+	buf = (BYTE *)av_malloc(CACHE_KEY_SAMPLE);
+	ctx = av_murmur3_alloc();
+	if ((buf == nullptr) || (ctx == nullptr)) {
+		av_free(buf);
+		av_free(ctx);
+		return false;
+	}
+	av_murmur3_init(ctx);
+	av_murmur3_update(ctx, (const uint8_t *)&length, sizeof(length));
+	n = pStreamIn->ReadAt(0, buf, CACHE_KEY_SAMPLE);
+	if (n > 0) {
+		av_murmur3_update(ctx, buf, n);
+	}
+	n = pStreamIn->ReadAt(
+		max(length - CACHE_KEY_SAMPLE, 0LL), buf, CACHE_KEY_SAMPLE);
+	if (n > 0) {
+		av_murmur3_update(ctx, buf, n);
+	}
+	av_murmur3_final(ctx, hash);
+	av_free(ctx);
+	av_free(buf);
+
+	swprintf_s(key, size, L"%016llx%016llx",
+		*(unsigned long long *)&hash[0], *(unsigned long long *)&hash[8]);
+
+	return true;
+}
+
+bool get_cache_path(
+	LPCWSTR key, LPCWSTR name, LPCWSTR ext, WCHAR *path, size_t size)
+{
+	WCHAR dir[MAX_PATH];
+	DWORD ret;
+
+	ret = GetEnvironmentVariableW(L"LOCALAPPDATA", dir, ARRAYSIZE(dir));
+	if ((ret == 0) || (ret >= ARRAYSIZE(dir))) {
+		return false;
+	}
+
+	wcscat_s(dir, ARRAYSIZE(dir), L"\\ffmpeg-w32codec");
+	CreateDirectoryW(dir, nullptr);
+	wcscat_s(dir, ARRAYSIZE(dir), L"\\");
+	wcscat_s(dir, ARRAYSIZE(dir), name);
+	CreateDirectoryW(dir, nullptr);
+	swprintf_s(path, size, L"%ls\\%ls.%ls", dir, key, ext);
+
+	return true;
+}
+
+void touch_cache(LPCWSTR path)
+{
+	HANDLE hFile;
+	FILETIME now;
+
+	// the last access time is not maintained on most volumes
+	hFile = CreateFileW(
+		path, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		return;
+	}
+	GetSystemTimeAsFileTime(&now);
+	SetFileTime(hFile, nullptr, nullptr, &now);
+	CloseHandle(hFile);
+}
+
+void trim_cache(LPCWSTR path)
+{
+	typedef struct {
+		ULONGLONG	time;
+		WCHAR		name[MAX_PATH];
+	} cache_file_t;
+
+	WCHAR dir[MAX_PATH];
+	WCHAR file[MAX_PATH];
+	WCHAR *p;
+	HANDLE hFind;
+	WIN32_FIND_DATAW data;
+	std::vector<cache_file_t> files;
+	DWORD limit = get_config_value("CacheMaxFiles", CACHE_MAX_FILES);
+
+	wcscpy_s(dir, ARRAYSIZE(dir), path);
+	p = wcsrchr(dir, L'\\');
+	if (p == nullptr) {
+		return;
+	}
+	*p = L'\0';
+	swprintf_s(file, ARRAYSIZE(file), L"%ls\\*", dir);
+
+	hFind = FindFirstFileW(file, &data);
+	if (hFind == INVALID_HANDLE_VALUE) {
+		return;
+	}
+	do {
+		cache_file_t entry;
+		if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+			continue;
+		}
+		entry.time = ((ULONGLONG)data.ftLastWriteTime.dwHighDateTime << 32) |
+			data.ftLastWriteTime.dwLowDateTime;
+		wcscpy_s(entry.name, ARRAYSIZE(entry.name), data.cFileName);
+		files.push_back(entry);
+	} while (FindNextFileW(hFind, &data));
+	FindClose(hFind);
+
+	if (files.size() <= limit) {
+		return;
+	}
+
+	// the oldest first
+	std::sort(files.begin(), files.end(),
+		[](const cache_file_t &a, const cache_file_t &b) {
+			return a.time < b.time;
+		});
+	for (size_t i=0; i<files.size()-limit; i++) {
+		swprintf_s(file, ARRAYSIZE(file), L"%ls\\%ls", dir, files[i].name);
+		if (!DeleteFileW(file)) {
+			LOGW("DeleteFileW() failed. (%lu)", GetLastError());
+		}
+	}
+	LOGD("trimmed %zu files from %ls", files.size() - limit, dir);
+}
+
+CKeyframeIndex::CKeyframeIndex()
+	: m_dirty(false)
+{
+	m_path[0] = L'\0';
+	m_timeBase.num = 0;
+	m_timeBase.den = 1;
+}
+
+bool CKeyframeIndex::Open(LPCWSTR key, const AVStream *pAVStream)
+{
+	CAutoLock lock(&m_cs);
+
+	m_entries.clear();
+	m_dirty = false;
+	m_path[0] = L'\0';
+	m_timeBase = pAVStream->time_base;
+
+	if (!get_cache_path(key, L"index", L"idx", m_path, ARRAYSIZE(m_path))) {
+		m_path[0] = L'\0';
+		return false;
+	}
+
+	Load();
+
+	return true;
+}
+
+void CKeyframeIndex::Load(void)
+{
+	HANDLE hFile;
+	key_index_header_t header;
+	DWORD size;
+	BOOL ok;
+
+	hFile = CreateFileW(
+		m_path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		return;
+	}
+
+	ok = ReadFile(hFile, &header, sizeof(header), &size, nullptr);
+	if (!ok || (size != sizeof(header)) ||
+		(header.magic != KEY_INDEX_MAGIC) ||
+		(header.version != KEY_INDEX_VERSION) ||
+		(header.time_base_num != m_timeBase.num) ||
+		(header.time_base_den != m_timeBase.den) ||
+		(header.count > KEY_INDEX_MAX_ENTRIES)) {
+		LOGW("ignored invalid index %ls", m_path);
+		CloseHandle(hFile);
+		return;
+	}
+
+	m_entries.resize(header.count);
+	ok = ReadFile(hFile, m_entries.data(),
+		header.count * sizeof(entry_t), &size, nullptr);
+	if (!ok || (size != header.count * sizeof(entry_t))) {
+		LOGW("ignored truncated index %ls", m_path);
+		m_entries.clear();
+	}
+	CloseHandle(hFile);
+	touch_cache(m_path);
+
+	LOGI("loaded %zu keyframes from %ls", m_entries.size(), m_path);
+}
+
+void CKeyframeIndex::Save(void)
+{
+	CAutoLock lock(&m_cs);
+	HANDLE hFile;
+	key_index_header_t header;
+	DWORD size;
+
+	if (!m_dirty || (m_path[0] == L'\0')) {
+		return;
+	}
+
+	hFile = CreateFileW(
+		m_path, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		LOGW("CreateFileW() failed. (%lu)", GetLastError());
+		return;
+	}
+
+	ZeroMemory(&header, sizeof(header));
+	header.magic = KEY_INDEX_MAGIC;
+	header.version = KEY_INDEX_VERSION;
+	header.time_base_num = m_timeBase.num;
+	header.time_base_den = m_timeBase.den;
+	header.count = (DWORD)m_entries.size();
+	WriteFile(hFile, &header, sizeof(header), &size, nullptr);
+	WriteFile(hFile, m_entries.data(),
+		header.count * sizeof(entry_t), &size, nullptr);
+	CloseHandle(hFile);
+
+	m_dirty = false;
+	trim_cache(m_path);
+}
+
+void CKeyframeIndex::Add(int64_t dts, int64_t pos)
+{
+	CAutoLock lock(&m_cs);
+	entry_t entry = { dts, pos };
+
+	if (m_path[0] == L'\0') {
+		return;
+	}
+
+	// appending in playback order is the common case
+	if (m_entries.empty() || (m_entries.back().dts < dts)) {
+		if (m_entries.size() >= KEY_INDEX_MAX_ENTRIES) {
+			return;
+		}
+		m_entries.push_back(entry);
+		m_dirty = true;
+		return;
+	}
+
+	auto it = std::lower_bound(m_entries.begin(), m_entries.end(), entry,
+		[](const entry_t &a, const entry_t &b) { return a.dts < b.dts; });
+	if ((it != m_entries.end()) && (it->dts == dts)) {
+		return;
+	}
+	if (m_entries.size() >= KEY_INDEX_MAX_ENTRIES) {
+		return;
+	}
+	m_entries.insert(it, entry);
+	m_dirty = true;
+}
+
+void CKeyframeIndex::Apply(AVStream *pAVStream)
+{
+	CAutoLock lock(&m_cs);
+
+	for (const entry_t &entry : m_entries) {
+		av_add_index_entry(
+			pAVStream, entry.pos, entry.dts, 0, 0, AVINDEX_KEYFRAME);
+	}
+}
+
+bool CKeyframeIndex::IsCovered(
+	const AVFormatContext *fmt, const AVStream *pAVStream)
+{
+	const AVIndexEntry *last;
+	int count = avformat_index_get_entries_count(pAVStream);
+	int64_t start = 0;
+	int64_t duration;
+
+	if (count < 2) {
+		return false;
+	}
+
+	// mpegps adds an entry for every PES header it has read, counting them
+	// says nothing; how far the last one reaches does
+	last = avformat_index_get_entry(pAVStream, count - 1);
+	if (pAVStream->duration != AV_NOPTS_VALUE) {
+		duration = pAVStream->duration;
+	} else if (fmt->duration != AV_NOPTS_VALUE) {
+		duration = av_rescale_q(
+			fmt->duration, av_make_q(1, AV_TIME_BASE), pAVStream->time_base);
+	} else {
+		return true;	// nothing to compare with
+	}
+	if (pAVStream->start_time != AV_NOPTS_VALUE) {
+		start = pAVStream->start_time;
+	}
+
+	return (last->timestamp - start) >=
+		duration * KEY_INDEX_COVERAGE / 100;
+}
@@ -8,11 +8,16 @@ static const AMOVIESETUP_MEDIATYPE g_media_types_stream_in[] = {
 };
 
 static const AMOVIESETUP_MEDIATYPE g_media_types_video_out[] = {
+	{ &MEDIATYPE_Video, &MEDIASUBTYPE_YV12 },
+	{ &MEDIATYPE_Video, &MEDIASUBTYPE_I420_ },
+	{ &MEDIATYPE_Video, &MEDIASUBTYPE_NV12 },
+	{ &MEDIATYPE_Video, &MEDIASUBTYPE_YUY2 },
 	{ &MEDIATYPE_Video, &MEDIASUBTYPE_RGB32 },
 	{ &MEDIATYPE_Video, &MEDIASUBTYPE_RGB24 },
 };
 
 static const AMOVIESETUP_MEDIATYPE g_media_types_audio_out[] = {
+	{ &MEDIATYPE_Audio, &MEDIASUBTYPE_IEEE_FLOAT },
 	{ &MEDIATYPE_Audio, &MEDIASUBTYPE_PCM },
 };
 
@@ -47,6 +52,33 @@ CFactoryTemplate g_Templates[] = {
 
 int g_cTemplates = ARRAYSIZE(g_Templates);
 
+DWORD get_config_value(LPCSTR name, DWORD value)
+{
+	static const HKEY roots[] = { HKEY_LOCAL_MACHINE, HKEY_CURRENT_USER };
+	HKEY hKey;
+	LONG ret;
+	DWORD type;
+	DWORD data;
+	DWORD size;
+
+	// HKCU overrides HKLM
+	for (size_t i=0; i<ARRAYSIZE(roots); i++) {
+		ret = RegOpenKeyExA(roots[i], CONFIG_REG_KEY, 0, KEY_READ, &hKey);
+		if (ret != ERROR_SUCCESS) {
+			continue;
+		}
+		size = sizeof(data);
+		ret = RegQueryValueExA(
+			hKey, name, nullptr, &type, (LPBYTE)&data, &size);
+		if ((ret == ERROR_SUCCESS) && (type == REG_DWORD)) {
+			value = data;
+		}
+		RegCloseKey(hKey);
+	}
+
+	return value;
+}
+
 extern "C" BOOL WINAPI DllEntryPoint(
 	HINSTANCE hInstance, ULONG ulReason, LPVOID pv);
 
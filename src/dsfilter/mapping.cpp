@@ -0,0 +1,141 @@
+// Copyright (c) 2024 Takahiro Ishida
+// Licensed under the MIT License.
+
+#include "dsfilter.h"
+
+static bool is_local_file(LPCWSTR path)
+{
+	WCHAR root[MAX_PATH];
+	UINT type;
+
+	if (!GetVolumePathNameW(path, root, ARRAYSIZE(root))) {
+		return false;
+	}
+
+	type = GetDriveTypeW(root);
+	return (type == DRIVE_FIXED) || (type == DRIVE_RAMDISK);
+}
+
+// A view page that cannot be brought in (the file was truncated, or the disk
+// failed) raises EXCEPTION_IN_PAGE_ERROR instead of failing a read.
+static bool copy_view(BYTE *dst, const BYTE *src, LONG size)
+{
+	__try {
+		CopyMemory(dst, src, size);
+	} __except ((GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR)?
+		EXCEPTION_EXECUTE_HANDLER:EXCEPTION_CONTINUE_SEARCH) {
+		return false;
+	}
+
+	return true;
+}
+
+CFileMapping::CFileMapping(LPCWSTR path, HRESULT *phr)
+	: m_hFile(INVALID_HANDLE_VALUE), m_hMapping(nullptr), m_pView(nullptr),
+	m_viewOffset(0), m_viewSize(0), m_length(0)
+{
+	LARGE_INTEGER size;
+
+	if (!is_local_file(path)) {
+		LOGD("%ls is not a local file", path);
+		*phr = E_FAIL;
+		return;
+	}
+
+	m_hFile = CreateFileW(
+		path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+		OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (m_hFile == INVALID_HANDLE_VALUE) {
+		LOGE("CreateFileW() failed. (%lu)", GetLastError());
+		*phr = E_FAIL;
+		return;
+	}
+
+	if (!GetFileSizeEx(m_hFile, &size) || (size.QuadPart == 0)) {
+		LOGE("GetFileSizeEx() failed. (%lu)", GetLastError());
+		*phr = E_FAIL;
+		return;
+	}
+	m_length = size.QuadPart;
+
+	m_hMapping = CreateFileMappingW(
+		m_hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (m_hMapping == nullptr) {
+		LOGE("CreateFileMappingW() failed. (%lu)", GetLastError());
+		*phr = E_FAIL;
+		return;
+	}
+
+	*phr = S_OK;
+}
+
+CFileMapping::~CFileMapping()
+{
+	if (m_pView != nullptr) {
+		UnmapViewOfFile(m_pView);
+	}
+	if (m_hMapping != nullptr) {
+		CloseHandle(m_hMapping);
+	}
+	if (m_hFile != INVALID_HANDLE_VALUE) {
+		CloseHandle(m_hFile);
+	}
+}
+
+LONG CFileMapping::Read(LONGLONG offset, BYTE *buf, LONG size)
+{
+	LONG done = 0;
+	LONGLONG pos;
+	LONG n;
+
+	while (done < size) {
+		pos = offset + done;
+		if (pos >= m_length) {
+			break;
+		}
+		if ((pos < m_viewOffset) || (pos >= m_viewOffset + m_viewSize)) {
+			if (!Map(pos)) {
+				return (done > 0)? done:-1;
+			}
+		}
+		n = (LONG)min(
+			(LONGLONG)(size - done), m_viewOffset + m_viewSize - pos);
+		if (!copy_view(buf + done, m_pView + (pos - m_viewOffset), n)) {
+			LOGE("in-page error at %lld", pos);
+			return -1;
+		}
+		done += n;
+	}
+
+	return done;
+}
+
+bool CFileMapping::Map(LONGLONG pos)
+{
+	SYSTEM_INFO si;
+	LONGLONG offset;
+
+	if (m_pView != nullptr) {
+		UnmapViewOfFile(m_pView);
+		m_pView = nullptr;
+		m_viewSize = 0;
+	}
+
+	// a sliding view keeps the address space use bounded for large files
+	GetSystemInfo(&si);
+	offset = pos - (pos % si.dwAllocationGranularity);
+	m_viewSize = (size_t)min(
+		(LONGLONG)FILE_MAPPING_VIEW_SIZE, m_length - offset);
+
+	m_pView = (BYTE *)MapViewOfFile(
+		m_hMapping, FILE_MAP_READ, (DWORD)(offset >> 32), (DWORD)offset,
+		m_viewSize);
+	if (m_pView == nullptr) {
+		LOGE("MapViewOfFile() failed. (%lu)", GetLastError());
+		m_viewSize = 0;
+		return false;
+	}
+	m_viewOffset = offset;
+
+	return true;
+}
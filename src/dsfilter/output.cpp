@@ -7,13 +7,24 @@ CFFmpegStreamOut::CFFmpegStreamOut(
 	LPCTSTR pObjectName, CFFmpegDSFilter *pFilter, CCritSec *pLock,
 	HRESULT *phr, LPCWSTR pName,
 	const AVStream *pAVStream, const AVCodec *pAVCodec)
-	: CBaseOutputPin(pObjectName, pFilter, pLock, phr, pName)
+	: CBaseOutputPin(pObjectName, pFilter, pLock, phr, pName),
+	m_packetQueue(PACKET_QUEUE_SIZE), m_queuedBytes(0), m_queuedDuration(0),
+	m_maxQueuedBytes(PACKET_QUEUE_VIDEO_BYTES),
+	m_frameQueue(FRAME_QUEUE_SIZE), m_hDeliverThread(nullptr),
+	m_hDeliverStop(nullptr), m_deliverResult(S_OK), m_pooled(false),
+	m_decodeTask(this, &CFFmpegStreamOut::RunDecode), m_decodeExit(false),
+	m_pPendingFrame(nullptr), m_decodeSent(false), m_decodeDraining(false),
+	m_packetsSent(0), m_framesReceived(0), m_framesSkipped(0),
+	m_decoderDelay(0), m_rtSegmentStart(0),
+	m_discontinuity(false), m_rtPosition(0), m_pAudioFifo(nullptr),
+	m_audioPacketSamples(0), m_audioAnchored(false), m_rtAudioAnchor(0),
+	m_audioSamples(0), m_pPoolAllocator(nullptr), m_qualityLate(0),
+	m_qualityStamp(0), m_skipLevel(0), m_qualityFrame(0), m_framesDropped(0),
+	m_framesDelivered(0), m_bytesDelivered(0), m_frameNumber(0)
 {
 	VIDEOINFOHEADER *vih;
 	WAVEFORMATEX *wfx;
 
-	m_hEvent = CreateEvent(nullptr, TRUE, TRUE, nullptr);
-
 	switch (pAVCodec->type)
 	{
 	case AVMEDIA_TYPE_VIDEO:
@@ -56,6 +67,7 @@ CFFmpegStreamOut::CFFmpegStreamOut(
 		m_mt.formattype = FORMAT_WaveFormatEx;
 		m_mt.cbFormat = sizeof(*wfx);
 		m_mt.pbFormat = (BYTE *)wfx;
+		m_maxQueuedBytes = PACKET_QUEUE_AUDIO_BYTES;
 		break;
 
 	default:
@@ -63,14 +75,123 @@ CFFmpegStreamOut::CFFmpegStreamOut(
 		return;
 	}
 
+	m_hDeliverStop = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+	if (m_hDeliverStop == nullptr) {
+		*phr = E_FAIL;
+		return;
+	}
+
+	m_pooled = pFilter->IsPooled();
+	m_streamIndex = pAVStream->index;
 	m_timeBase = 10000000 * av_q2d(pAVStream->time_base);
+	m_rtStartTime = pFilter->GetStartTime();
 	m_preroll = (LONGLONG)(pAVStream->start_time * m_timeBase);
 
+	ZeroMemory(&m_queueStats, sizeof(m_queueStats));
+
 	*phr = S_OK;
 }
 
 CFFmpegStreamOut::~CFFmpegStreamOut()
 {
+	AVPacket *packet;
+	AVFrame *frame;
+
+	while (m_packetQueue.TryPop(&packet)) {
+		av_packet_free(&packet);
+	}
+	while (m_frameQueue.TryPop(&frame)) {
+		av_frame_free(&frame);
+	}
+	av_frame_free(&m_pPendingFrame);
+	if (m_hDeliverStop != nullptr) {
+		CloseHandle(m_hDeliverStop);
+	}
+	if (m_pPoolAllocator != nullptr) {
+		m_pPoolAllocator->Release();
+	}
+	if (m_pAudioFifo != nullptr) {
+		av_audio_fifo_free(m_pAudioFifo);
+	}
+}
+
+bool CFFmpegStreamOut::EnqueuePacket(AVPacket *packet, HANDLE hAbort)
+{
+	LONGLONG bytes;
+	LONGLONG duration;
+
+	if (!m_packetQueue.WaitWhile(
+		[this]() { return IsQueueFull(); }, hAbort)) {
+		return false;
+	}
+
+	// account before pushing so that the consumer never sees negative totals
+	bytes = (m_queuedBytes += packet->size);
+	duration = (m_queuedDuration += GetPacketDuration(packet));
+	if (!m_packetQueue.Push(packet, hAbort)) {
+		m_queuedBytes -= packet->size;
+		m_queuedDuration -= GetPacketDuration(packet);
+		return false;
+	}
+
+	UpdateQueueStats(bytes, duration);
+	if (m_pooled) {
+		m_decodeTask.Wake();
+	}
+
+	return true;
+}
+
+void CFFmpegStreamOut::UpdateQueueStats(LONGLONG bytes, LONGLONG duration)
+{
+	LONGLONG size = (LONGLONG)m_packetQueue.Size();
+
+	if (m_queueStats.packets < size) {
+		m_queueStats.packets = size;
+	}
+	if (m_queueStats.bytes < bytes) {
+		m_queueStats.bytes = bytes;
+	}
+	if (m_queueStats.duration < duration) {
+		m_queueStats.duration = duration;
+	}
+}
+
+void CFFmpegStreamOut::ReleaseQueues(void)
+{
+	CFFmpegDSFilter *filter = static_cast<CFFmpegDSFilter *>(m_pFilter);
+	AVPacket *packet;
+	AVFrame *frame;
+
+	while (m_frameQueue.TryPop(&frame)) {
+		av_frame_free(&frame);
+	}
+	av_frame_free(&m_pPendingFrame);
+	while (DequeuePacket(&packet, nullptr)) {
+		filter->GetPacketPool()->Put(&packet);
+	}
+
+	LOGI("%ls: queue high-water %lld packets, %lld bytes, %lld ms",
+		Name(), m_queueStats.packets, m_queueStats.bytes,
+		m_queueStats.duration / 10000);
+}
+
+bool CFFmpegStreamOut::DequeuePacket(AVPacket **packet, HANDLE hWake)
+{
+	bool ret;
+
+	if (hWake != nullptr) {
+		ret = m_packetQueue.Pop(packet, hWake);
+	} else {
+		ret = m_packetQueue.TryPop(packet);
+	}
+	if (ret) {
+		m_queuedBytes -= (*packet)->size;
+		m_queuedDuration -= GetPacketDuration(*packet);
+		m_packetQueue.NotifyProducer();
+	}
+
+	return ret;
 }
 
 STDMETHODIMP CFFmpegStreamOut::NonDelegatingQueryInterface(
@@ -79,6 +200,9 @@ STDMETHODIMP CFFmpegStreamOut::NonDelegatingQueryInterface(
 	if (riid == IID_IMediaSeeking) {
 		return GetInterface(static_cast<IMediaSeeking *>(this), ppv);
 	}
+	if ((riid == IID_IAMDroppedFrames) && (m_mt.majortype == MEDIATYPE_Video)) {
+		return GetInterface(static_cast<IAMDroppedFrames *>(this), ppv);
+	}
 	return CBaseOutputPin::NonDelegatingQueryInterface(riid, ppv);
 }
 
@@ -119,6 +243,7 @@ HRESULT CFFmpegStreamOut::CheckConnect(IPin *pPin)
 
 HRESULT CFFmpegStreamOut::CheckMediaType(const CMediaType *pMediaType)
 {
+	CAutoLock lock(this);
 	OLECHAR *type_str;
 
 	if (pMediaType->majortype != m_mt.majortype) {
@@ -126,13 +251,18 @@ HRESULT CFFmpegStreamOut::CheckMediaType(const CMediaType *pMediaType)
 	}
 
 	if (pMediaType->majortype == MEDIATYPE_Video) {
-		if (pMediaType->formattype == FORMAT_VideoInfo) {
+		if ((pMediaType->formattype == FORMAT_VideoInfo) &&
+			is_subtype_video_out(pMediaType->subtype)) {
 			return S_OK;
 		} else {
 			return E_FAIL;
 		}
 	} else if (pMediaType->majortype == MEDIATYPE_Audio) {
-		if (pMediaType->formattype == FORMAT_WaveFormatEx) {
+		if ((pMediaType->formattype == FORMAT_WaveFormatEx) &&
+			(pMediaType->cbFormat >= sizeof(WAVEFORMATEX)) &&
+			is_subtype_audio_out(pMediaType->subtype) &&
+			(get_sample_format((WAVEFORMATEX *)pMediaType->pbFormat) !=
+			 AV_SAMPLE_FMT_NONE)) {
 			return S_OK;
 		} else {
 			return E_FAIL;
@@ -145,34 +275,156 @@ HRESULT CFFmpegStreamOut::CheckMediaType(const CMediaType *pMediaType)
 	}
 }
 
+HRESULT CFFmpegStreamOut::CompleteConnect(IPin *pReceivePin)
+{
+	CFFmpegDSFilter *filter = static_cast<CFFmpegDSFilter *>(m_pFilter);
+	HRESULT hr;
+
+	hr = CBaseOutputPin::CompleteConnect(pReceivePin);
+	if (FAILED(hr)) {
+		return hr;
+	}
+
+	if ((m_mt.majortype == MEDIATYPE_Audio) &&
+		(m_mt.formattype == FORMAT_WaveFormatEx)) {
+		WAVEFORMATEX *wfx = (WAVEFORMATEX *)m_mt.pbFormat;
+
+		filter->SetAudioOutput(wfx);
+
+		if (m_pAudioFifo != nullptr) {
+			av_audio_fifo_free(m_pAudioFifo);
+		}
+		m_audioPacketSamples = GetAudioPacketSamples();
+		m_pAudioFifo = av_audio_fifo_alloc(
+			get_sample_format(wfx), wfx->nChannels, m_audioPacketSamples * 2);
+		if (m_pAudioFifo == nullptr) {
+			LOGE("av_audio_fifo_alloc() failed.");
+			return E_OUTOFMEMORY;
+		}
+	}
+
+	filter->UpdateStreamDiscard(nullptr);
+
+	return S_OK;
+}
+
+HRESULT CFFmpegStreamOut::BreakConnect(void)
+{
+	CFFmpegDSFilter *filter = static_cast<CFFmpegDSFilter *>(m_pFilter);
+
+	// still connected until this returns
+	filter->UpdateStreamDiscard(this);
+
+	return CBaseOutputPin::BreakConnect();
+}
+
+HRESULT CFFmpegStreamOut::DecideAllocator(
+	IMemInputPin *pPin, IMemAllocator **ppAlloc)
+{
+	HRESULT hr;
+	ALLOCATOR_PROPERTIES prop;
+
+	// the video renderers hand out DirectDraw/Direct3D surfaces only through
+	// their own allocator, ours is just the fallback (InitAllocator())
+	if (m_mt.majortype != MEDIATYPE_Audio) {
+		return CBaseOutputPin::DecideAllocator(pPin, ppAlloc);
+	}
+
+	// unlike CBaseOutputPin, offer our own allocator first and fall back to
+	// the downstream one
+	ZeroMemory(&prop, sizeof(prop));
+	pPin->GetAllocatorRequirements(&prop);
+	if (prop.cbAlign == 0) {
+		prop.cbAlign = 1;
+	}
+
+	hr = InitAllocator(ppAlloc);
+	if (SUCCEEDED(hr)) {
+		hr = DecideBufferSize(*ppAlloc, &prop);
+		if (SUCCEEDED(hr)) {
+			hr = pPin->NotifyAllocator(*ppAlloc, FALSE);
+			if (SUCCEEDED(hr)) {
+				return S_OK;
+			}
+		}
+		(*ppAlloc)->Release();
+		*ppAlloc = nullptr;
+	}
+
+	return CBaseOutputPin::DecideAllocator(pPin, ppAlloc);
+}
+
+HRESULT CFFmpegStreamOut::InitAllocator(IMemAllocator **ppAlloc)
+{
+	HRESULT hr = S_OK;
+	CFFmpegAllocator *pAllocator;
+
+	pAllocator = new CFFmpegAllocator(
+		NAME("ffmpeg-w32codec Allocator"), nullptr, &hr);
+	if (FAILED(hr)) {
+		LOGE("new CFFmpegAllocator() failed. (0x%08x)", hr);
+		delete pAllocator;
+		return hr;
+	}
+
+	hr = pAllocator->NonDelegatingQueryInterface(
+		IID_IMemAllocator, (void **)ppAlloc);
+	if (FAILED(hr)) {
+		delete pAllocator;
+		return hr;
+	}
+
+	pAllocator->AddRef();
+	if (m_pPoolAllocator != nullptr) {
+		m_pPoolAllocator->Release();
+	}
+	m_pPoolAllocator = pAllocator;
+
+	return S_OK;
+}
+
 HRESULT CFFmpegStreamOut::DecideBufferSize(
 	IMemAllocator *pAllocator, ALLOCATOR_PROPERTIES *pProperties)
 {
 	HRESULT hr;
+	ALLOCATOR_PROPERTIES request;
 	ALLOCATOR_PROPERTIES actual;
+	LONG size;
 
-	// TODO
 	if (m_mt.majortype == MEDIATYPE_Audio) {
-		pProperties->cBuffers = 2;
-		pProperties->cbBuffer = (48000 * 2 * 2) / 20;
+		WAVEFORMATEX *wfx = (WAVEFORMATEX *)m_mt.pbFormat;
+		size = GetAudioPacketSamples() * wfx->nBlockAlign;
 	} else {
-		pProperties->cBuffers = 2;
-		pProperties->cbBuffer = m_mt.lSampleSize;
+		VIDEOINFOHEADER *vih = (VIDEOINFOHEADER *)m_mt.pbFormat;
+		size = max((LONG)m_mt.lSampleSize, (LONG)vih->bmiHeader.biSizeImage);
 	}
-	pProperties->cbAlign  = 1;
-	pProperties->cbPrefix = 0;
 
-	hr = pAllocator->SetProperties(pProperties, &actual);
+	request = *pProperties;
+	request.cBuffers = max(request.cBuffers, (LONG)ALLOCATOR_MIN_BUFFERS);
+	request.cbBuffer = max(request.cbBuffer, size);
+	request.cbAlign = max(request.cbAlign, (LONG)ALLOCATOR_ALIGN);
+
+	hr = pAllocator->SetProperties(&request, &actual);
+	if (hr == VFW_E_BADALIGN) {
+		// a downstream allocator may only take its own alignment
+		request.cbAlign = max(pProperties->cbAlign, 1L);
+		hr = pAllocator->SetProperties(&request, &actual);
+	}
 	if (FAILED(hr)) {
 		LOGE("IMemAllocator::SetProperties() failed. (0x%08x)", hr);
 		return hr;
 	}
+	if (actual.cbBuffer < size) {
+		LOGE("buffer too small %d < %d", actual.cbBuffer, size);
+		return E_FAIL;
+	}
 
 	return S_OK;
 }
 
 HRESULT CFFmpegStreamOut::GetMediaType(int iPosition, CMediaType *pMediaType)
 {
+	CAutoLock lock(this);
 	OLECHAR *type_str;
 
 	if (iPosition < 0) {
@@ -205,22 +457,34 @@ HRESULT CFFmpegStreamOut::GetMediaType(int iPosition, CMediaType *pMediaType)
 		}
 	} else if (m_mt.majortype == MEDIATYPE_Audio) {
 		if (m_mt.formattype == FORMAT_WaveFormatEx) {
-			WAVEFORMATEX *wfx =
-				(WAVEFORMATEX *)CoTaskMemAlloc(sizeof(*wfx));
-			CopyMemory(wfx, m_mt.pbFormat, sizeof(*wfx));
-			if (!get_format_audio_out(iPosition, wfx)) {
-				CoTaskMemFree(wfx);
+			CFFmpegDSFilter *filter = static_cast<CFFmpegDSFilter *>(m_pFilter);
+			WAVEFORMATEXTENSIBLE *wfex =
+				(WAVEFORMATEXTENSIBLE *)CoTaskMemAlloc(sizeof(*wfex));
+			WAVEFORMATEX *wfx = &wfex->Format;
+			AVChannelLayout ch_layout = {};
+			AVSampleFormat native;
+			bool ret;
+
+			ZeroMemory(wfex, sizeof(*wfex));
+			wfx->nChannels = ((WAVEFORMATEX *)m_mt.pbFormat)->nChannels;
+			wfx->nSamplesPerSec =
+				((WAVEFORMATEX *)m_mt.pbFormat)->nSamplesPerSec;
+			native = filter->GetAudioFormat(&ch_layout);
+			ret = get_format_audio_out(iPosition, native, &ch_layout, wfex);
+			av_channel_layout_uninit(&ch_layout);
+			if (!ret) {
+				CoTaskMemFree(wfex);
 				return VFW_S_NO_MORE_ITEMS;
 			}
 			pMediaType->majortype = MEDIATYPE_Audio;
-			pMediaType->subtype = get_subtype_audio_out(iPosition);
+			pMediaType->subtype = get_subtype_audio_out(wfx);
 			pMediaType->bFixedSizeSamples = TRUE;
 			pMediaType->bTemporalCompression = FALSE;
 			pMediaType->lSampleSize = wfx->nBlockAlign;
 			pMediaType->formattype = FORMAT_WaveFormatEx;
 			pMediaType->pUnk = nullptr;
-			pMediaType->cbFormat = sizeof(*wfx);
-			pMediaType->pbFormat = (BYTE *)wfx;
+			pMediaType->cbFormat = sizeof(*wfx) + wfx->cbSize;
+			pMediaType->pbFormat = (BYTE *)wfex;
 		} else {
 			StringFromCLSID(m_mt.formattype, &type_str);
 			LOGD("%s: formattype=%ls", __FUNCTION__, type_str);
@@ -243,18 +507,204 @@ HRESULT CFFmpegStreamOut::Active(void)
 	if (FAILED(hr)) {
 		return hr;
 	}
-	Create();
+
+	{
+		CAutoLock lock(&m_csDropped);
+		m_framesDropped = 0;
+		m_framesDelivered = 0;
+		m_bytesDelivered = 0;
+		m_frameNumber = 0;
+		m_qualityFrame = 0;
+		m_droppedInfo.clear();
+	}
+	StartThread();
 
 	return S_OK;
 }
 
 HRESULT CFFmpegStreamOut::Inactive(void)
 {
+	allocator_stats_t stats;
+
+	StopThread();
+	if (GetAllocatorStats(&stats)) {
+		LOGI("allocator: %lld buffers (peak %lld, +%lld/-%lld), "
+			"%lld/%lld waits, %lld us total, %lld us max, hold %lld us",
+			stats.buffers, stats.peakBuffers, stats.grown, stats.shrunk,
+			stats.waits, stats.requests, stats.waitUs, stats.maxWaitUs,
+			stats.holdUs);
+	}
+	if (m_mt.majortype == MEDIATYPE_Video) {
+		CAutoLock lock(&m_csDropped);
+		LOGI("%ls: %ld frames delivered, %ld dropped",
+			Name(), m_framesDelivered, m_framesDropped);
+	}
+
+	return CBaseOutputPin::Inactive();
+}
+
+bool CFFmpegStreamOut::GetAllocatorStats(allocator_stats_t *stats)
+{
+	if ((m_pPoolAllocator == nullptr) ||
+		(m_pAllocator != static_cast<IMemAllocator *>(m_pPoolAllocator))) {
+		return false;
+	}
+	m_pPoolAllocator->GetStats(stats);
+
+	return true;
+}
+
+void CFFmpegStreamOut::StartThread(void)
+{
+	CFFmpegDSFilter *filter = static_cast<CFFmpegDSFilter *>(m_pFilter);
+	AVPacket *packet;
+	AVFrame *frame;
+
+	// the demux thread may have queued more after this thread exited
+	while (m_packetQueue.TryPop(&packet)) {
+		filter->GetPacketPool()->Put(&packet);
+	}
+	m_packetQueue.Reset();
+	m_queuedBytes = 0;
+	m_queuedDuration = 0;
+	while (m_frameQueue.TryPop(&frame)) {
+		av_frame_free(&frame);
+	}
+	m_frameQueue.Reset();
+	ResetEvent(m_hDeliverStop);
+	if (m_pAudioFifo != nullptr) {
+		av_audio_fifo_reset(m_pAudioFifo);
+	}
+	m_audioAnchored = false;
+	m_audioSamples = 0;
+	// the lateness was measured against the previous segment
+	m_qualityLate = 0;
+	m_qualityStamp = 0;
+	if (m_skipLevel != 0) {
+		filter->SetDecoderSkip(
+			m_streamIndex, AVDISCARD_DEFAULT, AVDISCARD_DEFAULT);
+		m_skipLevel = 0;
+	}
+	// the decoder was flushed, its delay is learned again
+	m_packetsSent = 0;
+	m_framesReceived = 0;
+	m_framesSkipped = 0;
+	m_decoderDelay = 0;
+
+	if (!m_pooled) {
+		Create();
+		return;
+	}
+
+	m_deliverResult = S_OK;
+	m_decodeExit = false;
+	m_decodeSent = false;
+	m_decodeDraining = false;
+	m_hDeliverThread = CreateThread(
+		nullptr, 0, DeliverThreadProc, this, 0, nullptr);
+	if (m_hDeliverThread == nullptr) {
+		LOGE("CreateThread() failed. (%lu)", GetLastError());
+		// as the decode thread does, so that the graph still completes
+		DeliverEndOfStream();
+		return;
+	}
+	m_decodeTask.Start();
+}
+
+void CFFmpegStreamOut::StopThread(void)
+{
+	if (m_pooled) {
+		if (m_hDeliverThread == nullptr) {
+			return;
+		}
+		SetEvent(m_hDeliverStop);
+		m_decodeExit = true;
+		m_decodeTask.Wake();
+		m_decodeTask.WaitDone();
+		WaitForSingleObject(m_hDeliverThread, INFINITE);
+		CloseHandle(m_hDeliverThread);
+		m_hDeliverThread = nullptr;
+		ReleaseQueues();
+		return;
+	}
+
 	if (ThreadExists()) {
+		// the deliver thread may hold the decode thread on a full queue
+		SetEvent(m_hDeliverStop);
 		CallWorker(THREAD_REQ_EXIT);
 		Close();
 	}
-	return CBaseOutputPin::Inactive();
+}
+
+STDMETHODIMP CFFmpegStreamOut::Notify(IBaseFilter *pSender, Quality q)
+{
+	if (m_mt.majortype != MEDIATYPE_Video) {
+		return E_NOTIMPL;
+	}
+
+	// picked up by the decode thread before the next packet
+	{
+		CAutoLock lock(&m_csDropped);
+		m_qualityFrame = m_frameNumber;
+	}
+	m_qualityStamp = q.TimeStamp;
+	m_qualityLate = q.Late;
+
+	return S_OK;
+}
+
+STDMETHODIMP CFFmpegStreamOut::GetNumDropped(long *plDropped)
+{
+	CheckPointer(plDropped, E_POINTER);
+	CAutoLock lock(&m_csDropped);
+
+	*plDropped = m_framesDropped;
+
+	return S_OK;
+}
+
+STDMETHODIMP CFFmpegStreamOut::GetNumNotDropped(long *plNotDropped)
+{
+	CheckPointer(plNotDropped, E_POINTER);
+	CAutoLock lock(&m_csDropped);
+
+	*plNotDropped = m_framesDelivered;
+
+	return S_OK;
+}
+
+STDMETHODIMP CFFmpegStreamOut::GetDroppedInfo(
+	long lSize, long *plArray, long *plNumCopied)
+{
+	CheckPointer(plArray, E_POINTER);
+	CheckPointer(plNumCopied, E_POINTER);
+	CAutoLock lock(&m_csDropped);
+	long count = (long)m_droppedInfo.size();
+	long first = (count < QUALITY_DROPPED_INFO)?
+		0:(m_framesDropped % QUALITY_DROPPED_INFO);
+
+	if (lSize <= 0) {
+		return E_INVALIDARG;
+	}
+
+	// the oldest of the recorded frame numbers first
+	*plNumCopied = min(lSize, count);
+	for (long i=0; i<*plNumCopied; i++) {
+		plArray[i] = m_droppedInfo[(first + count - *plNumCopied + i) % count];
+	}
+
+	return S_OK;
+}
+
+STDMETHODIMP CFFmpegStreamOut::GetAverageFrameSize(long *plAverageSize)
+{
+	CheckPointer(plAverageSize, E_POINTER);
+	CAutoLock lock(&m_csDropped);
+
+	*plAverageSize = (m_framesDelivered > 0)?
+		(long)(m_bytesDelivered / m_framesDelivered):0;
+
+	return S_OK;
 }
 
 STDMETHODIMP CFFmpegStreamOut::GetCapabilities(DWORD *pCapabilities)
@@ -329,6 +779,11 @@ STDMETHODIMP CFFmpegStreamOut::SetPositions(
 	LONGLONG *pCurrent, DWORD dwCurrentFlags, LONGLONG *pStop,
 	DWORD dwStopFlags)
 {
+	CFFmpegDSFilter *filter = static_cast<CFFmpegDSFilter *>(m_pFilter);
+
+	if (filter->GetSeekingPin() != this) {
+		return S_OK;
+	}
 	return static_cast<CFFmpegDSFilter *>(m_pFilter)->SetPositions(
 		pCurrent, dwCurrentFlags, pStop, dwStopFlags);
 }
@@ -371,13 +826,18 @@ DWORD CFFmpegStreamOut::ThreadProc(void)
 	HRESULT hr = S_OK;
 	CFFmpegDSFilter *filter = static_cast<CFFmpegDSFilter *>(m_pFilter);
 	AVPacket *packet = nullptr;
-	AVFrame *frame_org = av_frame_alloc();
-	AVFrame *frame_cvt = av_frame_alloc();
-	IMediaSample *pSample = nullptr;
-	size_t offset;
-	size_t size;
+	int frames;
+	bool eos = false;
+
+	m_deliverResult = S_OK;
+	m_hDeliverThread = CreateThread(
+		nullptr, 0, DeliverThreadProc, this, 0, nullptr);
+	if (m_hDeliverThread == nullptr) {
+		LOGE("CreateThread() failed. (%lu)", GetLastError());
+		hr = E_FAIL;
+	}
 
-	while (true) {
+	while (SUCCEEDED(hr)) {
 		if (CheckRequest(nullptr)) {
 			DWORD req = GetRequest();
 			if (req == THREAD_REQ_EXIT) {
@@ -386,83 +846,433 @@ DWORD CFFmpegStreamOut::ThreadProc(void)
 			Reply(S_OK);
 		}
 
-		packet = DequeuePacket();
-		if (packet == nullptr) {
+		// sleep until a packet arrives or a request is sent
+		if (!DequeuePacket(&packet, GetRequestHandle())) {
+			if (m_packetQueue.IsEndOfStream()) {
+				eos = true;
+				break;
+			}
 			continue;
-		} else if (packet == (AVPacket *)-1) {
-			break;
 		}
 
-		ret = filter->Decode(frame_org, packet);
-		av_packet_free(&packet);
-		if (ret != 0) {
+		if (m_mt.majortype == MEDIATYPE_Video) {
+			UpdateDecoderSkip();
+		}
+
+		ret = filter->SendPacket(m_streamIndex, packet);
+		filter->GetPacketPool()->Put(&packet);
+		if (ret < 0) {
 			continue;
 		}
+		m_packetsSent++;
 
-		size = Convert(frame_cvt, frame_org);
-		if (size == (size_t)-1) {
-			LOGE("failed to convert");
+		hr = DecodeFrames(&frames);
+		if (hr != S_OK) {
 			break;
 		}
-		av_frame_unref(frame_org);
+		m_framesReceived += frames;
+		CountSkipped();
+	}
 
-		offset = 0;
-		while (offset < size) {
-			if (pSample == nullptr) {
-				hr = GetDeliveryBuffer(&pSample, nullptr, nullptr, 0);
-				if (FAILED(hr)) {
-					LOGE("GetDeliveryBuffer() failed. (0x%08x)", hr);
-					break;
-				}
-				pSample->SetActualDataLength(0);
+	if (eos) {
+		// a frame-threaded decoder still holds the last frames
+		ret = filter->SendPacket(m_streamIndex, nullptr);
+		if (ret == 0) {
+			hr = DecodeFrames(&frames);
+		}
+		filter->FlushDecoder(m_streamIndex);
+		m_frameQueue.SetEndOfStream();
+	} else {
+		SetEvent(m_hDeliverStop);
+	}
+
+	if (m_hDeliverThread != nullptr) {
+		WaitForSingleObject(m_hDeliverThread, INFINITE);
+		CloseHandle(m_hDeliverThread);
+		m_hDeliverThread = nullptr;
+		if (SUCCEEDED(hr)) {
+			hr = m_deliverResult;
+		}
+	} else {
+		DeliverEndOfStream();
+	}
+
+	ReleaseQueues();
+
+	Reply(hr);
+
+	return 0;
+}
+
+HRESULT CFFmpegStreamOut::DecodeFrames(int *frames)
+{
+	CFFmpegDSFilter *filter = static_cast<CFFmpegDSFilter *>(m_pFilter);
+	AVFrame *frame = nullptr;
+	HRESULT hr = S_OK;
+
+	*frames = 0;
+
+	// one packet may produce any number of frames
+	while (true) {
+		if (frame == nullptr) {
+			frame = av_frame_alloc();
+			if (frame == nullptr) {
+				hr = E_OUTOFMEMORY;
+				break;
 			}
-			hr = Prepare(pSample, frame_cvt, size, &offset);
-			if (hr == S_OK) {
-				hr = Deliver(pSample);
-				if (FAILED(hr)) {
-					LOGE("Deliver() failed. (0x%08x)", hr);
-					break;
+		}
+		if (0 != filter->ReceiveFrame(m_streamIndex, frame)) {
+			break;
+		}
+		// the deliver thread exits on a failure or a stop, the frame queue
+		// would stay full
+		if (!m_frameQueue.Push(frame, m_hDeliverThread)) {
+			hr = S_FALSE;
+			break;
+		}
+		frame = nullptr;
+		(*frames)++;
+	}
+	av_frame_free(&frame);
+
+	return hr;
+}
+
+int CFFmpegStreamOut::RunDecode(void)
+{
+	CFFmpegDSFilter *filter = static_cast<CFFmpegDSFilter *>(m_pFilter);
+	AVPacket *packet;
+	int ret;
+
+	for (int i=0; i<DECODE_TASK_PACKETS; i++) {
+		if (m_decodeExit.load()) {
+			FinishDecode(false);
+			return TASK_DONE;
+		}
+
+		// the frames of the last packet first, the deliver thread wakes this
+		// task when it takes one
+		while (true) {
+			if (m_pPendingFrame == nullptr) {
+				m_pPendingFrame = av_frame_alloc();
+				if (m_pPendingFrame == nullptr) {
+					LOGE("av_frame_alloc() failed.");
+					FinishDecode(false);
+					return TASK_DONE;
 				}
-				pSample->Release();
-				pSample = nullptr;
-			} else {
-				if (FAILED(hr)) {
-					LOGE("Prepare() failed. (0x%08x)", hr);
+				ret = filter->ReceiveFrame(m_streamIndex, m_pPendingFrame);
+				if (ret != 0) {
+					av_frame_free(&m_pPendingFrame);
+					break;
 				}
-				break;
+				m_framesReceived++;
 			}
+			if (!m_frameQueue.TryPush(m_pPendingFrame)) {
+				return TASK_WAIT;
+			}
+			m_pPendingFrame = nullptr;
 		}
-		av_frame_unref(frame_cvt);
 
-		if (FAILED(hr)) {
-			break;
+		if (m_decodeDraining) {
+			FinishDecode(true);
+			return TASK_DONE;
+		}
+
+		if (m_decodeSent) {
+			CountSkipped();
+		}
+		m_decodeSent = false;
+
+		// the demux thread wakes this task when it queues one
+		if (!DequeuePacket(&packet, nullptr)) {
+			if (!m_packetQueue.IsEndOfStream()) {
+				return TASK_WAIT;
+			}
+			// a frame-threaded decoder still holds the last frames
+			filter->SendPacket(m_streamIndex, nullptr);
+			m_decodeDraining = true;
+			continue;
+		}
+
+		if (m_mt.majortype == MEDIATYPE_Video) {
+			UpdateDecoderSkip();
+		}
+
+		ret = filter->SendPacket(m_streamIndex, packet);
+		filter->GetPacketPool()->Put(&packet);
+		m_decodeSent = (ret >= 0);
+		if (m_decodeSent) {
+			m_packetsSent++;
 		}
 	}
 
-	while (true) {
-		packet = DequeuePacket();
-		if ((packet == nullptr) || (packet == (AVPacket *)-1)) {
+	return TASK_YIELD;
+}
+
+void CFFmpegStreamOut::FinishDecode(bool eos)
+{
+	CFFmpegDSFilter *filter = static_cast<CFFmpegDSFilter *>(m_pFilter);
+
+	if (eos) {
+		filter->FlushDecoder(m_streamIndex);
+		m_frameQueue.SetEndOfStream();
+	} else {
+		SetEvent(m_hDeliverStop);
+	}
+}
+
+DWORD WINAPI CFFmpegStreamOut::DeliverThreadProc(LPVOID pParam)
+{
+	CFFmpegStreamOut *pin = static_cast<CFFmpegStreamOut *>(pParam);
+
+	pin->m_deliverResult = pin->DeliverLoop();
+
+	return 0;
+}
+
+HRESULT CFFmpegStreamOut::DeliverLoop(void)
+{
+	CFFmpegDSFilter *filter = static_cast<CFFmpegDSFilter *>(m_pFilter);
+	HRESULT hr;
+	HRESULT hr_eos;
+	AVFrame *frame = nullptr;
+	AVFrame *frame_cvt = av_frame_alloc();
+	LONGLONG start;
+	LONGLONG stop;
+
+	filter->GetSegment(&start, &stop);
+	m_rtSegmentStart = start;
+	m_discontinuity = true;
+	hr = DeliverNewSegment(start, stop, 1.0);
+	if (FAILED(hr)) {
+		LOGW("DeliverNewSegment() failed. (0x%08x)", hr);
+		hr = S_OK;
+	}
+
+	// sleep until a frame arrives or the decode thread stops this one
+	while (m_frameQueue.Pop(&frame, m_hDeliverStop)) {
+		// the decode task may be waiting for room
+		if (m_pooled) {
+			m_decodeTask.Wake();
+		}
+		hr = DeliverFrame(frame, frame_cvt);
+		av_frame_free(&frame);
+		if (FAILED(hr)) {
 			break;
 		}
-		av_packet_free(&packet);
 	}
 
-	av_frame_free(&frame_org);
+	// the last packet is shorter
+	if (SUCCEEDED(hr) && m_frameQueue.IsEndOfStream() &&
+		(m_pAudioFifo != nullptr) && (av_audio_fifo_size(m_pAudioFifo) > 0)) {
+		hr = DeliverAudioPacket(av_audio_fifo_size(m_pAudioFifo));
+	}
+
 	av_frame_free(&frame_cvt);
 
-	if (pSample != nullptr) {
-		Deliver(pSample);
+	hr_eos = DeliverEndOfStream();
+	if (FAILED(hr_eos)) {
+		LOGE("DeliverEndOfStream() failed. (0x%08x)", hr_eos);
+	}
+
+	// a failed delivery is what the decode thread has to report
+	return FAILED(hr)? hr:hr_eos;
+}
+
+HRESULT CFFmpegStreamOut::DeliverFrame(
+	const AVFrame *frame, AVFrame *frame_cvt)
+{
+	HRESULT hr;
+	size_t size;
+
+	if (m_mt.majortype == MEDIATYPE_Video) {
+		return DeliverVideoFrame(frame);
+	}
+
+	size = Convert(frame_cvt, frame);
+	if (size == (size_t)-1) {
+		LOGE("failed to convert");
+		return E_FAIL;
+	}
+
+	hr = QueueAudioFrame(frame_cvt);
+	av_frame_unref(frame_cvt);
+
+	return hr;
+}
+
+HRESULT CFFmpegStreamOut::DeliverVideoFrame(const AVFrame *frame)
+{
+	CFFmpegDSFilter *filter = static_cast<CFFmpegDSFilter *>(m_pFilter);
+	HRESULT hr;
+	IMediaSample *pSample = nullptr;
+	AM_MEDIA_TYPE *pmt = nullptr;
+	BYTE *dst;
+	LONG size;
+	REFERENCE_TIME rt_start = AV_NOPTS_VALUE;
+	REFERENCE_TIME rt_end = AV_NOPTS_VALUE;
+
+	if (m_mt.formattype != FORMAT_VideoInfo) {
+		return E_FAIL;
+	}
+
+	if (frame->best_effort_timestamp != AV_NOPTS_VALUE) {
+		rt_start = ToReferenceTime(frame->best_effort_timestamp);
+		rt_end = rt_start + (REFERENCE_TIME)(frame->duration * m_timeBase);
+	}
+
+	// the renderer would drop it, save the conversion
+	if ((rt_start != AV_NOPTS_VALUE) && IsTooLate(rt_start)) {
+		CountDropped();
+		return S_OK;
+	}
+
+	// scale straight into the downstream buffer
+	hr = GetDeliveryBuffer(&pSample, nullptr, nullptr, 0);
+	if (FAILED(hr)) {
+		LOGE("GetDeliveryBuffer() failed. (0x%08x)", hr);
+		return hr;
+	}
+
+	// VMR/EVR attach their surface stride to the first sample
+	if ((pSample->GetMediaType(&pmt) == S_OK) && (pmt != nullptr)) {
+		if ((pmt->formattype == FORMAT_VideoInfo) &&
+			(pmt->cbFormat >= sizeof(VIDEOINFOHEADER))) {
+			CMediaType mt(*pmt);
+			// not the filter lock, Inactive() holds it while joining this
+			// thread
+			CAutoLock lock(this);
+			SetMediaType(&mt);
+		}
+		DeleteMediaType(pmt);
+	}
+
+	hr = pSample->GetPointer(&dst);
+	if (FAILED(hr)) {
+		LOGE("IMediaSample::GetPointer() failed. (0x%08x)", hr);
 		pSample->Release();
-		pSample = nullptr;
+		return hr;
 	}
 
-	hr = DeliverEndOfStream();
+	size = filter->ScaleVideoFrame(dst, pSample->GetSize(), frame,
+		(VIDEOINFOHEADER *)m_mt.pbFormat, m_mt.subtype);
+	if (size < 0) {
+		LOGE("failed to convert");
+		pSample->Release();
+		return E_FAIL;
+	}
+
+	hr = pSample->SetActualDataLength(size);
 	if (FAILED(hr)) {
-		LOGE("DeliverEndOfStream() failed. (0x%08x)", hr);
+		LOGE("IMediaSample::SetActualDataLength() failed. (0x%08x)", hr);
+		pSample->Release();
+		return hr;
+	}
+	hr = SetSampleProperties(pSample,
+		(frame->flags & AV_FRAME_FLAG_KEY) != 0,
+		(frame->flags & AV_FRAME_FLAG_CORRUPT) != 0, rt_start, rt_end);
+	if (FAILED(hr)) {
+		pSample->Release();
+		return hr;
 	}
-	Reply(hr);
 
-	return 0;
+	hr = Deliver(pSample);
+	if (FAILED(hr)) {
+		LOGE("Deliver() failed. (0x%08x)", hr);
+	} else {
+		CAutoLock lock(&m_csDropped);
+		m_framesDelivered++;
+		m_bytesDelivered += size;
+		m_frameNumber++;
+	}
+	pSample->Release();
+
+	return hr;
+}
+
+void CFFmpegStreamOut::UpdateDecoderSkip(void)
+{
+	CFFmpegDSFilter *filter = static_cast<CFFmpegDSFilter *>(m_pFilter);
+	static const AVDiscard skip_frame[] = {
+		AVDISCARD_DEFAULT, AVDISCARD_NONREF, AVDISCARD_NONKEY
+	};
+	static const AVDiscard skip_loop_filter[] = {
+		AVDISCARD_DEFAULT, AVDISCARD_NONREF, AVDISCARD_ALL
+	};
+	LONGLONG late = GetQualityLate();
+	int level = m_skipLevel;
+
+	// raise at the threshold, lower at half of it
+	if (late >= QUALITY_SKIP_NONKEY_LATE) {
+		level = 2;
+	} else if (late >= QUALITY_SKIP_NONREF_LATE) {
+		if ((level < 2) || (late < QUALITY_SKIP_NONKEY_LATE / 2)) {
+			level = 1;
+		}
+	} else if (late < QUALITY_SKIP_NONREF_LATE / 2) {
+		level = 0;
+	} else if (level == 2) {
+		level = 1;
+	}
+
+	if (level != m_skipLevel) {
+		LOGD("%ls: skip level %d -> %d (late %lld ms)",
+			Name(), m_skipLevel, level, late / 10000);
+		filter->SetDecoderSkip(
+			m_streamIndex, skip_frame[level], skip_loop_filter[level]);
+		m_skipLevel = level;
+	}
+}
+
+LONGLONG CFFmpegStreamOut::GetQualityLate(void)
+{
+	CAutoLock lock(&m_csDropped);
+
+	// a renderer that has caught up may stop reporting, its last report
+	// must not keep the decoder skipping
+	if (m_frameNumber - m_qualityFrame > QUALITY_REPORT_FRAMES) {
+		return 0;
+	}
+
+	return m_qualityLate.load();
+}
+
+bool CFFmpegStreamOut::IsTooLate(REFERENCE_TIME rt_start)
+{
+	LONGLONG late = GetQualityLate();
+
+	// the renderer had reached stamp + late, anything before it is dropped
+	return (late > 0) &&
+		(rt_start - m_rtSegmentStart < m_qualityStamp.load() + late);
+}
+
+void CFFmpegStreamOut::CountSkipped(void)
+{
+	LONGLONG held = m_packetsSent - m_framesReceived - m_framesSkipped;
+
+	// a frame-threaded decoder returns nothing for its first packets by
+	// design; how many it holds is learned while nothing is skipped
+	if (m_skipLevel == 0) {
+		m_decoderDelay = max(m_decoderDelay, held);
+		return;
+	}
+	for (; held > m_decoderDelay; held--) {
+		CountDropped();
+		m_framesSkipped++;
+	}
+}
+
+void CFFmpegStreamOut::CountDropped(void)
+{
+	CAutoLock lock(&m_csDropped);
+
+	if (m_droppedInfo.size() < QUALITY_DROPPED_INFO) {
+		m_droppedInfo.push_back(m_frameNumber);
+	} else {
+		m_droppedInfo[m_framesDropped % QUALITY_DROPPED_INFO] = m_frameNumber;
+	}
+	m_framesDropped++;
+	m_frameNumber++;
 }
 
 size_t CFFmpegStreamOut::Convert(AVFrame *dst, const AVFrame *src)
@@ -470,12 +1280,7 @@ size_t CFFmpegStreamOut::Convert(AVFrame *dst, const AVFrame *src)
 	LONG ret = -1;
 	CFFmpegDSFilter *filter = static_cast<CFFmpegDSFilter *>(m_pFilter);
 
-	if (m_mt.majortype == MEDIATYPE_Video) {
-		if (m_mt.formattype == FORMAT_VideoInfo) {
-			VIDEOINFOHEADER *vih = (VIDEOINFOHEADER *)m_mt.pbFormat;
-			ret = filter->ConvertVideoFrame(dst, src, vih, m_mt.subtype);
-		}
-	} else if (m_mt.majortype == MEDIATYPE_Audio) {
+	if (m_mt.majortype == MEDIATYPE_Audio) {
 		if (m_mt.formattype == FORMAT_WaveFormatEx) {
 			WAVEFORMATEX *wfx = (WAVEFORMATEX *)m_mt.pbFormat;
 			ret = filter->ConvertAudioFrame(dst, src, wfx);
@@ -493,94 +1298,142 @@ size_t CFFmpegStreamOut::Convert(AVFrame *dst, const AVFrame *src)
 	return ret;
 }
 
-HRESULT CFFmpegStreamOut::Prepare(
-	IMediaSample *pSample, const AVFrame *frame, size_t size, size_t *offset)
+LONG CFFmpegStreamOut::GetAudioPacketSamples(void) const
+{
+	WAVEFORMATEX *wfx = (WAVEFORMATEX *)m_mt.pbFormat;
+	DWORD ms = get_config_value("AudioPacketMs", AUDIO_PACKET_MS);
+
+	ms = min(max(ms, 1UL), 1000UL);
+
+	return max((LONG)(wfx->nSamplesPerSec * ms / 1000), 1L);
+}
+
+HRESULT CFFmpegStreamOut::QueueAudioFrame(const AVFrame *frame)
 {
 	HRESULT hr;
-	const BYTE *src;
+	int queued = av_audio_fifo_size(m_pAudioFifo);
+	REFERENCE_TIME rt;
+	REFERENCE_TIME expected;
+
+	// the clock runs on the sample count, a timestamp too far from it (the
+	// first frame, a gap in the stream) sends what is queued and restarts it
+	if (frame->best_effort_timestamp != AV_NOPTS_VALUE) {
+		rt = ToReferenceTime(frame->best_effort_timestamp);
+		expected = m_rtAudioAnchor + SamplesToTime(m_audioSamples + queued);
+		if (!m_audioAnchored ||
+			(llabs(rt - expected) > AUDIO_RESYNC_THRESHOLD)) {
+			if (queued > 0) {
+				hr = DeliverAudioPacket(queued);
+				if (FAILED(hr)) {
+					return hr;
+				}
+			}
+			m_rtAudioAnchor = rt;
+			m_audioSamples = 0;
+			m_audioAnchored = true;
+		}
+	}
+
+	if (av_audio_fifo_write(m_pAudioFifo, (void **)frame->extended_data,
+		frame->nb_samples) < frame->nb_samples) {
+		LOGE("av_audio_fifo_write() failed.");
+		return E_OUTOFMEMORY;
+	}
+
+	while (av_audio_fifo_size(m_pAudioFifo) >= m_audioPacketSamples) {
+		hr = DeliverAudioPacket(m_audioPacketSamples);
+		if (FAILED(hr)) {
+			return hr;
+		}
+	}
+
+	return S_OK;
+}
+
+HRESULT CFFmpegStreamOut::DeliverAudioPacket(int samples)
+{
+	WAVEFORMATEX *wfx = (WAVEFORMATEX *)m_mt.pbFormat;
+	HRESULT hr;
+	IMediaSample *pSample = nullptr;
 	BYTE *dst;
-	LONG src_offset;
-	LONG dst_offset;
-	LONG src_len;
-	LONG dst_len;
-	BOOL sync_point = (frame->flags & AV_FRAME_FLAG_KEY)? TRUE:FALSE;
-	BOOL discontinuity = (frame->flags & AV_FRAME_FLAG_CORRUPT)? TRUE:FALSE;
-	REFERENCE_TIME rt_start;
-	REFERENCE_TIME rt_end;
-	REFERENCE_TIME rt_duration;
-	int64_t pts = frame->best_effort_timestamp;
-	int64_t duration;
-	const double time_base = m_timeBase;
-	bool delivery = false;
+	REFERENCE_TIME rt_start = AV_NOPTS_VALUE;
+	REFERENCE_TIME rt_end = AV_NOPTS_VALUE;
 
+	hr = GetDeliveryBuffer(&pSample, nullptr, nullptr, 0);
+	if (FAILED(hr)) {
+		LOGE("GetDeliveryBuffer() failed. (0x%08x)", hr);
+		return hr;
+	}
 	hr = pSample->GetPointer(&dst);
 	if (FAILED(hr)) {
 		LOGE("IMediaSample::GetPointer() failed. (0x%08x)", hr);
+		pSample->Release();
 		return hr;
 	}
 
-	src_offset = *offset;
-	dst_offset = pSample->GetActualDataLength();
-	src_len = size - src_offset;
-	dst_len = pSample->GetSize() - dst_offset;
+	// a downstream allocator may have given less than asked for
+	samples = min(samples, (int)(pSample->GetSize() / wfx->nBlockAlign));
+	samples = av_audio_fifo_read(m_pAudioFifo, (void **)&dst, samples);
+	if (samples <= 0) {
+		LOGE("av_audio_fifo_read() failed. (%d)", samples);
+		pSample->Release();
+		return E_FAIL;
+	}
 
-	if (dst_offset == 0) {
-		pts += frame->duration * (src_offset / (double)size);
+	hr = pSample->SetActualDataLength(samples * wfx->nBlockAlign);
+	if (FAILED(hr)) {
+		LOGE("IMediaSample::SetActualDataLength() failed. (0x%08x)", hr);
+		pSample->Release();
+		return hr;
 	}
 
-	if (m_mt.majortype == MEDIATYPE_Video) {
-		int h = frame->height;
-		int pitch = frame->linesize[0];
-		if ((src_offset != 0) || (dst_offset != 0)) {
-			return E_FAIL;
-		}
-		if (src_len > dst_len) {
-			return E_FAIL;
-		}
-		src = (BYTE *)frame->data[0] + (h - 1) * pitch;
-		for (int y=0; y<h; y++) {
-			CopyMemory(dst, src, pitch);
-			src -= pitch;
-			dst += pitch;
-		}
-		*offset = size;
-		duration = frame->duration;
-		delivery = true;
-	} else if (m_mt.majortype == MEDIATYPE_Audio) {
-		src = frame->data[0] + src_offset;
-		if (src_len > dst_len) {
-			src_len = dst_len;
-		}
-		CopyMemory(dst + dst_offset, src, src_len);
-		*offset += src_len;
-		duration = frame->duration * (src_len / (double)size);
-		delivery = (dst_offset + src_len == pSample->GetSize());
-	} else {
-		return E_FAIL;
+	if (m_audioAnchored) {
+		rt_start = m_rtAudioAnchor + SamplesToTime(m_audioSamples);
+		rt_end = m_rtAudioAnchor + SamplesToTime(m_audioSamples + samples);
 	}
+	m_audioSamples += samples;
 
-	hr = pSample->SetActualDataLength(dst_offset + src_len);
+	hr = SetSampleProperties(pSample, true, false, rt_start, rt_end);
 	if (FAILED(hr)) {
-		LOGE("IMediaSample::SetActualDataLength() failed. (0x%08x)", hr);
+		pSample->Release();
 		return hr;
 	}
-	hr = pSample->SetSyncPoint(sync_point);
+
+	hr = Deliver(pSample);
+	if (FAILED(hr)) {
+		LOGE("Deliver() failed. (0x%08x)", hr);
+	}
+	pSample->Release();
+
+	return hr;
+}
+
+HRESULT CFFmpegStreamOut::SetSampleProperties(
+	IMediaSample *pSample, bool sync_point, bool corrupt,
+	REFERENCE_TIME rt_start, REFERENCE_TIME rt_end)
+{
+	HRESULT hr;
+
+	hr = pSample->SetSyncPoint(sync_point? TRUE:FALSE);
 	if (FAILED(hr)) {
 		LOGE("IMediaSample::SetSyncPoint() failed. (0x%08x)", hr);
 		return hr;
 	}
-	hr = pSample->SetDiscontinuity(discontinuity);
+	hr = pSample->SetDiscontinuity((corrupt || m_discontinuity)? TRUE:FALSE);
 	if (FAILED(hr)) {
 		LOGE("IMediaSample::SetDiscontinuity() failed. (0x%08x)", hr);
 		return hr;
 	}
+	m_discontinuity = false;
 
-	if (pts == AV_NOPTS_VALUE) {
+	if (rt_start == AV_NOPTS_VALUE) {
 		return S_OK;
 	}
-	rt_start = (REFERENCE_TIME)(pts * time_base);
-	rt_duration = (REFERENCE_TIME)(duration * time_base);
-	rt_end = rt_start + rt_duration;
+	m_rtPosition = rt_start;
+
+	// relative to the segment, samples before the seek target are preroll
+	rt_start -= m_rtSegmentStart;
+	rt_end -= m_rtSegmentStart;
 
 	hr = pSample->SetTime(&rt_start, &rt_end);
 	if (FAILED(hr)) {
@@ -598,10 +1451,5 @@ HRESULT CFFmpegStreamOut::Prepare(
 		return hr;
 	}
 
-//	LOGD("%c(%d): %d - %d (%d / %d / %d)",
-//		(m_mt.majortype == MEDIATYPE_Video)? 'V':'A', sync_point,
-//		(int)(rt_start / 100), (int)(rt_end / 100), (int)(rt_duration / 100),
-//		send_len, dst_len);
-
-	return delivery? S_OK:S_FALSE;
+	return S_OK;
 }
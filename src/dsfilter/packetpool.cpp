@@ -0,0 +1,81 @@
+// Copyright (c) 2024 Takahiro Ishida
+// Licensed under the MIT License.
+
+#include "dsfilter.h"
+
+CPacketPool::CPacketPool()
+	: m_allocated(0), m_recycled(0), m_released(0)
+{
+	InitializeSListHead(&m_packets);
+	InitializeSListHead(&m_nodes);
+}
+
+CPacketPool::~CPacketPool()
+{
+	node_t *node;
+	LONGLONG allocated = m_allocated.load();
+	LONGLONG recycled = m_recycled.load();
+
+	LOGI("packet pool: %lld allocated, %lld recycled (%.1f%%), %lld released",
+		allocated, recycled,
+		(allocated + recycled > 0)?
+			recycled * 100.0 / (allocated + recycled):0.0,
+		m_released.load());
+
+	while ((node = (node_t *)InterlockedPopEntrySList(&m_packets)) != nullptr) {
+		av_packet_free(&node->packet);
+		_aligned_free(node);
+	}
+	while ((node = (node_t *)InterlockedPopEntrySList(&m_nodes)) != nullptr) {
+		_aligned_free(node);
+	}
+}
+
+AVPacket * CPacketPool::Get(void)
+{
+	node_t *node;
+	AVPacket *packet;
+
+	node = (node_t *)InterlockedPopEntrySList(&m_packets);
+	if (node == nullptr) {
+		m_allocated++;
+		return av_packet_alloc();
+	}
+	packet = node->packet;
+	InterlockedPushEntrySList(&m_nodes, &node->entry);
+	m_recycled++;
+
+	return packet;
+}
+
+void CPacketPool::Put(AVPacket **packet)
+{
+	node_t *node;
+
+	if (*packet == nullptr) {
+		return;
+	}
+
+	// the payload goes back to libavformat's allocator right away, only the
+	// shell is kept
+	av_packet_unref(*packet);
+
+	if (QueryDepthSList(&m_packets) >= PACKET_POOL_SIZE) {
+		av_packet_free(packet);
+		m_released++;
+		return;
+	}
+	node = (node_t *)InterlockedPopEntrySList(&m_nodes);
+	if (node == nullptr) {
+		node = (node_t *)_aligned_malloc(
+			sizeof(*node), MEMORY_ALLOCATION_ALIGNMENT);
+		if (node == nullptr) {
+			av_packet_free(packet);
+			m_released++;
+			return;
+		}
+	}
+	node->packet = *packet;
+	InterlockedPushEntrySList(&m_packets, &node->entry);
+	*packet = nullptr;
+}
@@ -0,0 +1,127 @@
+// Copyright (c) 2024 Takahiro Ishida
+// Licensed under the MIT License.
+
+#include "dsfilter.h"
+
+#include <math.h>
+
+#include <emmintrin.h>
+
+// the build targets pentiumpro, SSE2 is used only when the CPU has it; the
+// Win32 ABI keeps the stack only 4-byte aligned, and an __m128 spill needs 16
+#ifdef _MSC_VER
+#define TARGET_SSE2
+#else
+#define TARGET_SSE2	\
+	__attribute__((target("sse2"), force_align_arg_pointer))
+#endif
+
+static bool has_sse2(void)
+{
+	// FFmpeg is built with --disable-asm, av_get_cpu_flags() knows nothing
+	static const bool sse2 =
+		(IsProcessorFeaturePresent(PF_XMMI64_INSTRUCTIONS_AVAILABLE) != FALSE);
+
+	return sse2;
+}
+
+static void fltp_to_s16_c(
+	int16_t *dst, const float * const *src, int channels, int start,
+	int samples)
+{
+	dst += start * channels;
+	for (int i=start; i<samples; i++) {
+		for (int ch=0; ch<channels; ch++) {
+			// clipped before scaling like the SSE2 code, lrintf() of a
+			// value beyond the long range is undefined
+			*dst++ = av_clip_int16(
+				lrintf(av_clipf(src[ch][i], -1.0f, 1.0f) * 32768.0f));
+		}
+	}
+}
+
+// returns the number of samples converted, the rest is left to the C code
+TARGET_SSE2 static int fltp_to_s16_sse2(
+	int16_t *dst, const float * const *src, int channels, int samples)
+{
+	const __m128 lo = _mm_set1_ps(-1.0f);
+	const __m128 hi = _mm_set1_ps(1.0f);
+	const __m128 scale = _mm_set1_ps(32768.0f);
+	int i = 0;
+
+	// 1.0 becomes 32768 and is saturated to 32767 by the pack
+	if (channels == 2) {
+		for (; i + 4 <= samples; i += 4) {
+			__m128 l = _mm_loadu_ps(src[0] + i);
+			__m128 r = _mm_loadu_ps(src[1] + i);
+			l = _mm_mul_ps(_mm_min_ps(_mm_max_ps(l, lo), hi), scale);
+			r = _mm_mul_ps(_mm_min_ps(_mm_max_ps(r, lo), hi), scale);
+			// l0 l1 l2 l3 r0 r1 r2 r3 -> l0 r0 l1 r1 l2 r2 l3 r3
+			__m128i lr = _mm_packs_epi32(_mm_cvtps_epi32(l), _mm_cvtps_epi32(r));
+			_mm_storeu_si128((__m128i *)(dst + i * 2),
+				_mm_unpacklo_epi16(lr, _mm_srli_si128(lr, 8)));
+		}
+	} else if (channels == 1) {
+		for (; i + 8 <= samples; i += 8) {
+			__m128 a = _mm_loadu_ps(src[0] + i);
+			__m128 b = _mm_loadu_ps(src[0] + i + 4);
+			a = _mm_mul_ps(_mm_min_ps(_mm_max_ps(a, lo), hi), scale);
+			b = _mm_mul_ps(_mm_min_ps(_mm_max_ps(b, lo), hi), scale);
+			_mm_storeu_si128((__m128i *)(dst + i),
+				_mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b)));
+		}
+	}
+
+	return i;
+}
+
+void convert_fltp_to_s16(
+	int16_t *dst, const float * const *src, int channels, int samples)
+{
+	int done = 0;
+
+	if (has_sse2()) {
+		done = fltp_to_s16_sse2(dst, src, channels, samples);
+	}
+	fltp_to_s16_c(dst, src, channels, done, samples);
+}
+
+static void fltp_to_flt_c(
+	float *dst, const float * const *src, int channels, int start,
+	int samples)
+{
+	dst += start * channels;
+	for (int i=start; i<samples; i++) {
+		for (int ch=0; ch<channels; ch++) {
+			*dst++ = src[ch][i];
+		}
+	}
+}
+
+TARGET_SSE2 static int fltp_to_flt_sse2(
+	float *dst, const float * const *src, int channels, int samples)
+{
+	int i = 0;
+
+	if (channels == 2) {
+		for (; i + 4 <= samples; i += 4) {
+			__m128 l = _mm_loadu_ps(src[0] + i);
+			__m128 r = _mm_loadu_ps(src[1] + i);
+			_mm_storeu_ps(dst + i * 2, _mm_unpacklo_ps(l, r));
+			_mm_storeu_ps(dst + i * 2 + 4, _mm_unpackhi_ps(l, r));
+		}
+	}
+
+	return i;
+}
+
+void convert_fltp_to_flt(
+	float *dst, const float * const *src, int channels, int samples)
+{
+	int done = 0;
+
+	if (has_sse2()) {
+		done = fltp_to_flt_sse2(dst, src, channels, samples);
+	}
+	fltp_to_flt_c(dst, src, channels, done, samples);
+}
@@ -0,0 +1,278 @@
+// Copyright (c) 2024 Takahiro Ishida
+// Licensed under the MIT License.
+
+#include "dsfilter.h"
+
+#define PROBE_CACHE_MAGIC	0x43505746	// "FWPC"
+#define PROBE_CACHE_VERSION	1
+
+typedef struct {
+	DWORD		magic;
+	DWORD		version;
+	DWORD		nb_streams;
+	DWORD		reserved;
+	int64_t		start_time;
+	int64_t		duration;
+	int64_t		bit_rate;
+} probe_cache_header_t;
+
+typedef struct {
+	int32_t		codec_type;
+	int32_t		codec_id;
+	uint32_t	codec_tag;
+	int32_t		format;
+	int64_t		bit_rate;
+	int32_t		bits_per_coded_sample;
+	int32_t		bits_per_raw_sample;
+	int32_t		profile;
+	int32_t		level;
+	int32_t		width;
+	int32_t		height;
+	int32_t		sample_aspect_ratio_num;
+	int32_t		sample_aspect_ratio_den;
+	int32_t		field_order;
+	int32_t		video_delay;
+	int32_t		ch_order;			// AV_CHANNEL_ORDER_NATIVE or _UNSPEC
+	int32_t		nb_channels;
+	uint64_t	ch_mask;
+	int32_t		sample_rate;
+	int32_t		block_align;
+	int32_t		frame_size;
+	int32_t		initial_padding;
+	int32_t		time_base_num;
+	int32_t		time_base_den;
+	int32_t		avg_frame_rate_num;
+	int32_t		avg_frame_rate_den;
+	int32_t		r_frame_rate_num;
+	int32_t		r_frame_rate_den;
+	int64_t		start_time;
+	int64_t		duration;
+	int64_t		nb_frames;
+	uint32_t	extradata_size;		// followed by the extradata
+	uint32_t	reserved;
+} probe_cache_stream_t;
+
+CProbeCache::CProbeCache()
+{
+	m_path[0] = L'\0';
+}
+
+bool CProbeCache::Open(LPCWSTR key)
+{
+	if (!get_cache_path(key, L"probe", L"prb", m_path, ARRAYSIZE(m_path))) {
+		m_path[0] = L'\0';
+		return false;
+	}
+
+	return true;
+}
+
+bool CProbeCache::Apply(AVFormatContext *fmt)
+{
+	HANDLE hFile;
+	probe_cache_header_t header;
+	std::vector<probe_cache_stream_t> entries;
+	std::vector<std::vector<uint8_t>> extradata;
+	DWORD size;
+	BOOL ok;
+
+	if (m_path[0] == L'\0') {
+		return false;
+	}
+
+	hFile = CreateFileW(
+		m_path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	ok = ReadFile(hFile, &header, sizeof(header), &size, nullptr);
+	if (!ok || (size != sizeof(header)) ||
+		(header.magic != PROBE_CACHE_MAGIC) ||
+		(header.version != PROBE_CACHE_VERSION) ||
+		(header.nb_streams != fmt->nb_streams)) {
+		LOGW("ignored invalid probe cache %ls", m_path);
+		CloseHandle(hFile);
+		return false;
+	}
+
+	// read everything before touching the streams, a partial entry would
+	// leave them half restored
+	entries.resize(header.nb_streams);
+	extradata.resize(header.nb_streams);
+	for (DWORD i=0; i<header.nb_streams; i++) {
+		probe_cache_stream_t *entry = &entries[i];
+		const AVStream *stream = fmt->streams[i];
+
+		ok = ReadFile(hFile, entry, sizeof(*entry), &size, nullptr);
+		if (!ok || (size != sizeof(*entry)) ||
+			(entry->codec_type != stream->codecpar->codec_type) ||
+			(entry->codec_id != stream->codecpar->codec_id) ||
+			(entry->time_base_num != stream->time_base.num) ||
+			(entry->time_base_den != stream->time_base.den) ||
+			(entry->extradata_size > PROBE_CACHE_MAX_EXTRADATA)) {
+			LOGW("ignored mismatching probe cache %ls", m_path);
+			CloseHandle(hFile);
+			return false;
+		}
+		extradata[i].resize(entry->extradata_size);
+		ok = ReadFile(hFile, extradata[i].data(),
+			entry->extradata_size, &size, nullptr);
+		if (!ok || (size != entry->extradata_size)) {
+			LOGW("ignored truncated probe cache %ls", m_path);
+			CloseHandle(hFile);
+			return false;
+		}
+	}
+	CloseHandle(hFile);
+
+	for (DWORD i=0; i<header.nb_streams; i++) {
+		const probe_cache_stream_t *entry = &entries[i];
+		AVStream *stream = fmt->streams[i];
+		AVCodecParameters *par = stream->codecpar;
+
+		par->codec_tag = entry->codec_tag;
+		par->format = entry->format;
+		par->bit_rate = entry->bit_rate;
+		par->bits_per_coded_sample = entry->bits_per_coded_sample;
+		par->bits_per_raw_sample = entry->bits_per_raw_sample;
+		par->profile = entry->profile;
+		par->level = entry->level;
+		par->width = entry->width;
+		par->height = entry->height;
+		par->sample_aspect_ratio.num = entry->sample_aspect_ratio_num;
+		par->sample_aspect_ratio.den = entry->sample_aspect_ratio_den;
+		par->field_order = (AVFieldOrder)entry->field_order;
+		par->video_delay = entry->video_delay;
+		av_channel_layout_uninit(&par->ch_layout);
+		if (entry->ch_order == AV_CHANNEL_ORDER_NATIVE) {
+			av_channel_layout_from_mask(&par->ch_layout, entry->ch_mask);
+		} else {
+			par->ch_layout.order = AV_CHANNEL_ORDER_UNSPEC;
+			par->ch_layout.nb_channels = entry->nb_channels;
+		}
+		par->sample_rate = entry->sample_rate;
+		par->block_align = entry->block_align;
+		par->frame_size = entry->frame_size;
+		par->initial_padding = entry->initial_padding;
+		stream->avg_frame_rate.num = entry->avg_frame_rate_num;
+		stream->avg_frame_rate.den = entry->avg_frame_rate_den;
+		stream->r_frame_rate.num = entry->r_frame_rate_num;
+		stream->r_frame_rate.den = entry->r_frame_rate_den;
+		stream->start_time = entry->start_time;
+		stream->duration = entry->duration;
+		stream->nb_frames = entry->nb_frames;
+
+		// the demuxer's own extradata is as good, only fill in what a parser
+		// extracted during the probe
+		if ((par->extradata_size == 0) && !extradata[i].empty()) {
+			par->extradata = (uint8_t *)av_mallocz(
+				extradata[i].size() + AV_INPUT_BUFFER_PADDING_SIZE);
+			if (par->extradata != nullptr) {
+				memcpy(par->extradata, extradata[i].data(),
+					extradata[i].size());
+				par->extradata_size = (int)extradata[i].size();
+			}
+		}
+	}
+	fmt->start_time = header.start_time;
+	fmt->duration = header.duration;
+	fmt->bit_rate = header.bit_rate;
+
+	touch_cache(m_path);
+
+	LOGI("restored %u streams from %ls", header.nb_streams, m_path);
+
+	return true;
+}
+
+void CProbeCache::Save(const AVFormatContext *fmt)
+{
+	HANDLE hFile;
+	probe_cache_header_t header;
+	DWORD size;
+
+	if (m_path[0] == L'\0') {
+		return;
+	}
+
+	// a layout that cannot be stored as a mask is probed every time
+	for (unsigned int i=0; i<fmt->nb_streams; i++) {
+		const AVCodecParameters *par = fmt->streams[i]->codecpar;
+		if ((par->ch_layout.order != AV_CHANNEL_ORDER_NATIVE) &&
+			(par->ch_layout.order != AV_CHANNEL_ORDER_UNSPEC)) {
+			return;
+		}
+		if (par->extradata_size > PROBE_CACHE_MAX_EXTRADATA) {
+			return;
+		}
+	}
+
+	hFile = CreateFileW(
+		m_path, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		LOGW("CreateFileW() failed. (%lu)", GetLastError());
+		return;
+	}
+
+	ZeroMemory(&header, sizeof(header));
+	header.magic = PROBE_CACHE_MAGIC;
+	header.version = PROBE_CACHE_VERSION;
+	header.nb_streams = fmt->nb_streams;
+	header.start_time = fmt->start_time;
+	header.duration = fmt->duration;
+	header.bit_rate = fmt->bit_rate;
+	WriteFile(hFile, &header, sizeof(header), &size, nullptr);
+
+	for (unsigned int i=0; i<fmt->nb_streams; i++) {
+		const AVStream *stream = fmt->streams[i];
+		const AVCodecParameters *par = stream->codecpar;
+		probe_cache_stream_t entry;
+
+		ZeroMemory(&entry, sizeof(entry));
+		entry.codec_type = par->codec_type;
+		entry.codec_id = par->codec_id;
+		entry.codec_tag = par->codec_tag;
+		entry.format = par->format;
+		entry.bit_rate = par->bit_rate;
+		entry.bits_per_coded_sample = par->bits_per_coded_sample;
+		entry.bits_per_raw_sample = par->bits_per_raw_sample;
+		entry.profile = par->profile;
+		entry.level = par->level;
+		entry.width = par->width;
+		entry.height = par->height;
+		entry.sample_aspect_ratio_num = par->sample_aspect_ratio.num;
+		entry.sample_aspect_ratio_den = par->sample_aspect_ratio.den;
+		entry.field_order = par->field_order;
+		entry.video_delay = par->video_delay;
+		entry.ch_order = par->ch_layout.order;
+		entry.nb_channels = par->ch_layout.nb_channels;
+		if (par->ch_layout.order == AV_CHANNEL_ORDER_NATIVE) {
+			entry.ch_mask = par->ch_layout.u.mask;
+		}
+		entry.sample_rate = par->sample_rate;
+		entry.block_align = par->block_align;
+		entry.frame_size = par->frame_size;
+		entry.initial_padding = par->initial_padding;
+		entry.time_base_num = stream->time_base.num;
+		entry.time_base_den = stream->time_base.den;
+		entry.avg_frame_rate_num = stream->avg_frame_rate.num;
+		entry.avg_frame_rate_den = stream->avg_frame_rate.den;
+		entry.r_frame_rate_num = stream->r_frame_rate.num;
+		entry.r_frame_rate_den = stream->r_frame_rate.den;
+		entry.start_time = stream->start_time;
+		entry.duration = stream->duration;
+		entry.nb_frames = stream->nb_frames;
+		entry.extradata_size = par->extradata_size;
+		WriteFile(hFile, &entry, sizeof(entry), &size, nullptr);
+		if (par->extradata_size > 0) {
+			WriteFile(hFile, par->extradata, par->extradata_size, &size,
+				nullptr);
+		}
+	}
+	CloseHandle(hFile);
+
+	trim_cache(m_path);
+}
@@ -0,0 +1,271 @@
+// Copyright (c) 2024 Takahiro Ishida
+// Licensed under the MIT License.
+
+#include "dsfilter.h"
+
+CReadAhead::CReadAhead(IAsyncReader *pReader, HRESULT *phr)
+	: m_pReader(pReader), m_pAllocator(nullptr), m_blockSize(0),
+	m_blockCount(0), m_align(1), m_total(0), m_next(0)
+{
+	HRESULT hr;
+	ALLOCATOR_PROPERTIES props;
+	ALLOCATOR_PROPERTIES actual;
+	LONGLONG avail;
+
+	ZeroMemory(m_blocks, sizeof(m_blocks));
+	m_pReader->AddRef();
+
+	hr = m_pReader->Length(&m_total, &avail);
+	if (FAILED(hr)) {
+		LOGE("IAsyncReader::Length() failed. (0x%08x)", hr);
+		*phr = hr;
+		return;
+	}
+
+	props.cBuffers = READAHEAD_BLOCKS;
+	props.cbBuffer = READAHEAD_BLOCK_SIZE;
+	props.cbAlign = 1;
+	props.cbPrefix = 0;
+	hr = m_pReader->RequestAllocator(nullptr, &props, &m_pAllocator);
+	if (FAILED(hr)) {
+		LOGE("IAsyncReader::RequestAllocator() failed. (0x%08x)", hr);
+		*phr = hr;
+		return;
+	}
+
+	hr = m_pAllocator->GetProperties(&actual);
+	if (FAILED(hr)) {
+		LOGE("IMemAllocator::GetProperties() failed. (0x%08x)", hr);
+		*phr = hr;
+		return;
+	}
+	if (actual.cbAlign > 1) {
+		m_align = actual.cbAlign;
+	}
+	m_blockSize = actual.cbBuffer - (actual.cbBuffer % m_align);
+	m_blockCount = min(actual.cBuffers, READAHEAD_BLOCKS);
+	if ((m_blockSize <= 0) || (m_blockCount <= 0)) {
+		LOGE("unusable allocator (%d x %d)", actual.cBuffers, actual.cbBuffer);
+		*phr = E_FAIL;
+		return;
+	}
+
+	hr = m_pAllocator->Commit();
+	if (FAILED(hr)) {
+		LOGE("IMemAllocator::Commit() failed. (0x%08x)", hr);
+		*phr = hr;
+		return;
+	}
+
+	for (int i=0; i<m_blockCount; i++) {
+		hr = m_pAllocator->GetBuffer(&m_blocks[i].pSample, nullptr, nullptr, 0);
+		if (FAILED(hr)) {
+			LOGE("IMemAllocator::GetBuffer() failed. (0x%08x)", hr);
+			*phr = hr;
+			return;
+		}
+	}
+
+	*phr = S_OK;
+}
+
+CReadAhead::~CReadAhead()
+{
+	Cancel();
+
+	for (int i=0; i<m_blockCount; i++) {
+		if (m_blocks[i].pSample != nullptr) {
+			m_blocks[i].pSample->Release();
+		}
+	}
+	if (m_pAllocator != nullptr) {
+		m_pAllocator->Decommit();
+		m_pAllocator->Release();
+	}
+	m_pReader->Release();
+}
+
+LONG CReadAhead::Read(LONGLONG offset, BYTE *buf, LONG size)
+{
+	HRESULT hr;
+	LONG done = 0;
+	LONGLONG pos;
+	LONGLONG avail;
+	LONG n;
+	block_t *block;
+	BYTE *data;
+
+	while (done < size) {
+		pos = offset + done;
+		if (pos >= m_total) {
+			break;
+		}
+
+		block = Find(pos);
+		if (block == nullptr) {
+			// seek or back-read outside of the window
+			hr = Restart(pos);
+			if (FAILED(hr)) {
+				return -1;
+			}
+			continue;
+		}
+
+		if (block->pending) {
+			hr = WaitFor(block);
+			if (FAILED(hr)) {
+				return -1;
+			}
+		}
+
+		avail = block->start + block->length - pos;
+		if (avail <= 0) {
+			break;
+		}
+		n = (LONG)min(avail, (LONGLONG)(size - done));
+
+		hr = block->pSample->GetPointer(&data);
+		if (FAILED(hr)) {
+			LOGE("IMediaSample::GetPointer() failed. (0x%08x)", hr);
+			return -1;
+		}
+		CopyMemory(buf + done, data + (pos - block->start), n);
+		done += n;
+
+		if (n == avail) {
+			// consumed, move it to the front of the window
+			hr = Issue(block);
+			if (FAILED(hr)) {
+				return -1;
+			}
+		}
+	}
+
+	return done;
+}
+
+CReadAhead::block_t *CReadAhead::Find(LONGLONG pos)
+{
+	for (int i=0; i<m_blockCount; i++) {
+		block_t *block = &m_blocks[i];
+		if ((block->start <= pos) && (pos < block->start + block->length)) {
+			return block;
+		}
+	}
+	return nullptr;
+}
+
+HRESULT CReadAhead::Issue(block_t *block)
+{
+	HRESULT hr;
+	REFERENCE_TIME start;
+	REFERENCE_TIME stop;
+
+	block->length = 0;
+	if (m_next >= m_total) {
+		return S_OK;
+	}
+
+	// the reader trims the request at the end of file
+	start = m_next * UNITS;
+	stop = (m_next + m_blockSize) * UNITS;
+	block->pSample->SetTime(&start, &stop);
+	hr = m_pReader->Request(block->pSample, (DWORD_PTR)block);
+	if (FAILED(hr)) {
+		LOGE("IAsyncReader::Request() failed. (0x%08x)", hr);
+		return hr;
+	}
+
+	block->start = m_next;
+	block->length = m_blockSize;
+	block->pending = true;
+	m_next += m_blockSize;
+
+	return S_OK;
+}
+
+HRESULT CReadAhead::WaitFor(block_t *block)
+{
+	HRESULT hr;
+	IMediaSample *pSample;
+	DWORD_PTR user;
+	block_t *done;
+
+	while (block->pending) {
+		pSample = nullptr;
+		user = 0;
+		hr = m_pReader->WaitForNext(INFINITE, &pSample, &user);
+		if (pSample == nullptr) {
+			LOGE("IAsyncReader::WaitForNext() failed. (0x%08x)", hr);
+			return FAILED(hr)? hr:E_FAIL;
+		}
+		done = (block_t *)user;
+		done->pending = false;
+		if (SUCCEEDED(hr)) {
+			done->length = min(
+				(LONGLONG)pSample->GetActualDataLength(),
+				m_total - done->start);
+		} else {
+			done->length = 0;
+			if (done == block) {
+				LOGE("IAsyncReader::WaitForNext() failed. (0x%08x)", hr);
+				return hr;
+			}
+		}
+	}
+
+	return S_OK;
+}
+
+void CReadAhead::Cancel(void)
+{
+	HRESULT hr;
+	IMediaSample *pSample;
+	DWORD_PTR user;
+	int pending = 0;
+
+	for (int i=0; i<m_blockCount; i++) {
+		if (m_blocks[i].pending) {
+			pending++;
+		}
+	}
+
+	if (pending > 0) {
+		// outstanding requests complete with an error while flushing
+		m_pReader->BeginFlush();
+		while (pending > 0) {
+			pSample = nullptr;
+			hr = m_pReader->WaitForNext(INFINITE, &pSample, &user);
+			if (pSample == nullptr) {
+				LOGE("IAsyncReader::WaitForNext() failed. (0x%08x)", hr);
+				break;
+			}
+			((block_t *)user)->pending = false;
+			pending--;
+		}
+		m_pReader->EndFlush();
+	}
+
+	for (int i=0; i<m_blockCount; i++) {
+		m_blocks[i].start = 0;
+		m_blocks[i].length = 0;
+		m_blocks[i].pending = false;
+	}
+}
+
+HRESULT CReadAhead::Restart(LONGLONG pos)
+{
+	HRESULT hr;
+
+	Cancel();
+
+	m_next = pos - (pos % m_align);
+	for (int i=0; i<m_blockCount; i++) {
+		hr = Issue(&m_blocks[i]);
+		if (FAILED(hr)) {
+			return hr;
+		}
+	}
+
+	return S_OK;
+}
@@ -0,0 +1,189 @@
+// Copyright (c) 2024 Takahiro Ishida
+// Licensed under the MIT License.
+
+#pragma once
+
+#include <windows.h>
+
+#include <atomic>
+
+#define SPSC_CACHE_LINE_SIZE	64
+
+// Bounded single-producer/single-consumer queue.
+//
+// TryPush()/TryPop() never take a lock.  Push()/Pop() block on an event only
+// while the queue is full/empty, and the other side signals that event only
+// when it sees a waiter.
+template <typename T>
+class CSPSCQueue
+{
+public:
+	CSPSCQueue(size_t capacity)
+		: m_head(0), m_tail(0), m_producerWaiting(false),
+		m_consumerWaiting(false), m_endOfStream(false)
+	{
+		size_t n = 1;
+		while (n < capacity) {
+			n <<= 1;
+		}
+		m_items = new T[n];
+		m_mask = n - 1;
+		m_hNotFull = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+		m_hNotEmpty = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+	}
+
+	~CSPSCQueue() {
+		CloseHandle(m_hNotFull);
+		CloseHandle(m_hNotEmpty);
+		delete [] m_items;
+	}
+
+	size_t Capacity(void) const {
+		return m_mask + 1;
+	}
+
+	size_t Size(void) const {
+		return m_tail.load(std::memory_order_acquire)
+			- m_head.load(std::memory_order_acquire);
+	}
+
+	// producer
+	bool TryPush(const T &item) {
+		size_t tail = m_tail.load(std::memory_order_relaxed);
+		if (tail - m_head.load(std::memory_order_acquire) > m_mask) {
+			return false;
+		}
+		m_items[tail & m_mask] = item;
+		m_tail.store(tail + 1, std::memory_order_seq_cst);
+		if (m_consumerWaiting.load(std::memory_order_seq_cst)) {
+			SetEvent(m_hNotEmpty);
+		}
+		return true;
+	}
+
+	// producer: blocks while full, returns false if hAbort is signaled
+	bool Push(const T &item, HANDLE hAbort = nullptr) {
+		while (!TryPush(item)) {
+			m_producerWaiting.store(true, std::memory_order_seq_cst);
+			if (TryPush(item)) {
+				m_producerWaiting.store(false, std::memory_order_relaxed);
+				break;
+			}
+			if (!Wait(m_hNotFull, hAbort)) {
+				m_producerWaiting.store(false, std::memory_order_relaxed);
+				return false;
+			}
+			m_producerWaiting.store(false, std::memory_order_relaxed);
+		}
+		return true;
+	}
+
+	// producer: blocks while isFull() holds, returns false if hAbort is
+	// signaled.  The consumer must call NotifyProducer() after every change
+	// that may make isFull() false.
+	template <typename Pred>
+	bool WaitWhile(Pred isFull, HANDLE hAbort = nullptr) {
+		while (isFull()) {
+			m_producerWaiting.store(true, std::memory_order_seq_cst);
+			if (!isFull()) {
+				m_producerWaiting.store(false, std::memory_order_relaxed);
+				break;
+			}
+			if (!Wait(m_hNotFull, hAbort)) {
+				m_producerWaiting.store(false, std::memory_order_relaxed);
+				return false;
+			}
+			m_producerWaiting.store(false, std::memory_order_relaxed);
+		}
+		return true;
+	}
+
+	// producer: no more items will be pushed
+	void SetEndOfStream(void) {
+		m_endOfStream.store(true, std::memory_order_seq_cst);
+		SetEvent(m_hNotEmpty);
+	}
+
+	// consumer
+	bool TryPop(T *item) {
+		size_t head = m_head.load(std::memory_order_relaxed);
+		if (head == m_tail.load(std::memory_order_acquire)) {
+			return false;
+		}
+		*item = m_items[head & m_mask];
+		m_head.store(head + 1, std::memory_order_seq_cst);
+		if (m_producerWaiting.load(std::memory_order_seq_cst)) {
+			SetEvent(m_hNotFull);
+		}
+		return true;
+	}
+
+	// consumer: wakes the producer blocked in Push() or WaitWhile()
+	void NotifyProducer(void) {
+		if (m_producerWaiting.load(std::memory_order_seq_cst)) {
+			SetEvent(m_hNotFull);
+		}
+	}
+
+	// consumer: blocks while empty, returns false at the end of stream or
+	// if hWake is signaled
+	bool Pop(T *item, HANDLE hWake = nullptr) {
+		while (!TryPop(item)) {
+			if (m_endOfStream.load(std::memory_order_seq_cst)) {
+				return TryPop(item);
+			}
+			m_consumerWaiting.store(true, std::memory_order_seq_cst);
+			if (TryPop(item)) {
+				m_consumerWaiting.store(false, std::memory_order_relaxed);
+				break;
+			}
+			if (m_endOfStream.load(std::memory_order_seq_cst)) {
+				m_consumerWaiting.store(false, std::memory_order_relaxed);
+				return TryPop(item);
+			}
+			if (!Wait(m_hNotEmpty, hWake)) {
+				m_consumerWaiting.store(false, std::memory_order_relaxed);
+				return false;
+			}
+			m_consumerWaiting.store(false, std::memory_order_relaxed);
+		}
+		return true;
+	}
+
+	// consumer: true once the end of stream was set and all items are popped
+	bool IsEndOfStream(void) const {
+		return m_endOfStream.load(std::memory_order_seq_cst) && (Size() == 0);
+	}
+
+	// only while neither side is running, after popping all items
+	void Reset(void) {
+		m_head.store(0);
+		m_tail.store(0);
+		m_producerWaiting.store(false);
+		m_consumerWaiting.store(false);
+		m_endOfStream.store(false);
+		ResetEvent(m_hNotFull);
+		ResetEvent(m_hNotEmpty);
+	}
+
+private:
+	bool Wait(HANDLE hEvent, HANDLE hOther) {
+		HANDLE handles[] = { hEvent, hOther };
+		DWORD ret = WaitForMultipleObjects(
+			(hOther != nullptr)? 2:1, handles, FALSE, INFINITE);
+		return (ret == WAIT_OBJECT_0);
+	}
+
+	T *					m_items;
+	size_t				m_mask;
+	HANDLE				m_hNotFull;
+	HANDLE				m_hNotEmpty;
+	char				m_pad0[SPSC_CACHE_LINE_SIZE];
+	std::atomic<size_t>	m_head;		// written by the consumer
+	char				m_pad1[SPSC_CACHE_LINE_SIZE - sizeof(size_t)];
+	std::atomic<size_t>	m_tail;		// written by the producer
+	char				m_pad2[SPSC_CACHE_LINE_SIZE - sizeof(size_t)];
+	std::atomic<bool>	m_producerWaiting;
+	std::atomic<bool>	m_consumerWaiting;
+	std::atomic<bool>	m_endOfStream;
+};
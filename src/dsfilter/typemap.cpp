@@ -11,10 +11,13 @@ typedef struct {
 typedef struct {
 	REFGUID			subtype;
 	AVPixelFormat	pix_fmt;
+	DWORD			compression;
 	WORD			planes;
 	WORD			bpp;
 } pixfmt_map_t;
 
+const FOURCCMap MEDIASUBTYPE_I420_(MAKEFOURCC('I', '4', '2', '0'));
+
 static codec_map_t g_codec_map_video[] = {
 	{ MEDIASUBTYPE_MPEG1Payload,		AV_CODEC_ID_MPEG1VIDEO },
 	{ MEDIASUBTYPE_NULL,				AV_CODEC_ID_NONE }
@@ -26,9 +29,19 @@ static codec_map_t g_codec_map_audio[] = {
 	{ MEDIASUBTYPE_NULL,				AV_CODEC_ID_NONE }
 };
 
+// in order of preference; the 4:2:0 planar ones are a plain copy of what
+// the MPEG decoders output, RGB is the fallback for the old renderers
 static pixfmt_map_t g_pixfmt_map[] = {
-	{ MEDIASUBTYPE_RGB32, AV_PIX_FMT_RGB32, 1, 32 },
-	{ MEDIASUBTYPE_RGB24, AV_PIX_FMT_RGB24, 1, 24 },
+	{ MEDIASUBTYPE_YV12,	AV_PIX_FMT_YUV420P,
+		MAKEFOURCC('Y', 'V', '1', '2'), 1, 12 },
+	{ MEDIASUBTYPE_I420_,	AV_PIX_FMT_YUV420P,
+		MAKEFOURCC('I', '4', '2', '0'), 1, 12 },
+	{ MEDIASUBTYPE_NV12,	AV_PIX_FMT_NV12,
+		MAKEFOURCC('N', 'V', '1', '2'), 1, 12 },
+	{ MEDIASUBTYPE_YUY2,	AV_PIX_FMT_YUYV422,
+		MAKEFOURCC('Y', 'U', 'Y', '2'), 1, 16 },
+	{ MEDIASUBTYPE_RGB32,	AV_PIX_FMT_RGB32,	BI_RGB, 1, 32 },
+	{ MEDIASUBTYPE_RGB24,	AV_PIX_FMT_RGB24,	BI_RGB, 1, 24 },
 };
 static size_t g_pixfmt_map_cnt = ARRAYSIZE(g_pixfmt_map);
 
@@ -96,7 +109,7 @@ bool is_subtype_video_out(REFGUID subtype)
 		return false;
 	}
 
-	for (int i=0; g_pixfmt_map[i].subtype != MEDIASUBTYPE_NULL; i++) {
+	for (unsigned int i=0; i<g_pixfmt_map_cnt; i++) {
 		if (g_pixfmt_map[i].subtype == subtype) {
 			return true;
 		}
@@ -107,7 +120,8 @@ bool is_subtype_video_out(REFGUID subtype)
 
 bool is_subtype_audio_out(REFGUID subtype)
 {
-	return (subtype == MEDIASUBTYPE_PCM);
+	return (subtype == MEDIASUBTYPE_PCM) ||
+		(subtype == MEDIASUBTYPE_IEEE_FLOAT);
 }
 
 AVPixelFormat get_pixel_format(REFGUID subtype)
@@ -118,7 +132,7 @@ AVPixelFormat get_pixel_format(REFGUID subtype)
 		return AV_PIX_FMT_NONE;
 	}
 
-	for (unsigned int i=0; g_pixfmt_map_cnt; i++) {
+	for (unsigned int i=0; i<g_pixfmt_map_cnt; i++) {
 		if (g_pixfmt_map[i].subtype == subtype) {
 			return g_pixfmt_map[i].pix_fmt;
 		}
@@ -139,10 +153,10 @@ REFGUID get_subtype_video_out(unsigned int index)
 	return g_pixfmt_map[index].subtype;
 }
 
-REFGUID get_subtype_audio_out(unsigned int index)
+REFGUID get_subtype_audio_out(const WAVEFORMATEX *wfx)
 {
-	if (index != 0) {
-		return GUID_NULL;
+	if (get_sample_format(wfx) == AV_SAMPLE_FMT_FLT) {
+		return MEDIASUBTYPE_IEEE_FLOAT;
 	}
 	return MEDIASUBTYPE_PCM;
 }
@@ -155,28 +169,180 @@ bool get_format_video_out(unsigned int index, VIDEOINFOHEADER *vih)
 
 	vih->bmiHeader.biPlanes = g_pixfmt_map[index].planes;
 	vih->bmiHeader.biBitCount = g_pixfmt_map[index].bpp;
-	vih->bmiHeader.biCompression = BI_RGB;
-	vih->bmiHeader.biSizeImage =
-		((vih->bmiHeader.biWidth * vih->bmiHeader.biBitCount + 31) & ~31) / 8
-		* vih->bmiHeader.biHeight;
+	vih->bmiHeader.biCompression = g_pixfmt_map[index].compression;
+	vih->bmiHeader.biSizeImage = get_video_planes(
+		vih, g_pixfmt_map[index].subtype, nullptr, nullptr, nullptr);
 
 	return true;
 }
 
-bool get_format_audio_out(unsigned int index, WAVEFORMATEX *wfx)
+LONG get_video_planes(
+	const VIDEOINFOHEADER *vih, REFGUID subtype, BYTE *base,
+	uint8_t *data[4], int linesize[4])
 {
-	if (index != 0) {
-		return false;
+	LONG width = vih->bmiHeader.biWidth;
+	LONG height = abs(vih->bmiHeader.biHeight);
+	LONG stride;
+	LONG chroma;
+	uint8_t *planes[4] = { base, nullptr, nullptr, nullptr };
+	int strides[4] = { 0, 0, 0, 0 };
+	LONG size;
+
+	// biWidth is the stride in pixels, YUV is always top-down
+	if ((subtype == MEDIASUBTYPE_YV12) || (subtype == MEDIASUBTYPE_I420_)) {
+		stride = width;
+		chroma = ((stride + 1) / 2) * ((height + 1) / 2);
+		strides[0] = stride;
+		strides[1] = strides[2] = (stride + 1) / 2;
+		if (base != nullptr) {
+			// YV12 stores V before U
+			int first = (subtype == MEDIASUBTYPE_YV12)? 2:1;
+			planes[first] = base + stride * height;
+			planes[3 - first] = planes[first] + chroma;
+		}
+		size = stride * height + chroma * 2;
+	} else if (subtype == MEDIASUBTYPE_NV12) {
+		stride = width;
+		strides[0] = strides[1] = stride;
+		if (base != nullptr) {
+			planes[1] = base + stride * height;
+		}
+		size = stride * height + stride * ((height + 1) / 2);
+	} else if (subtype == MEDIASUBTYPE_YUY2) {
+		stride = width * 2;
+		strides[0] = stride;
+		size = stride * height;
+	} else {
+		// a bottom-up DIB is written from its last row with a negative stride
+		stride = ((width * vih->bmiHeader.biBitCount + 31) & ~31) / 8;
+		strides[0] = stride;
+		if ((base != nullptr) && (vih->bmiHeader.biHeight > 0)) {
+			planes[0] = base + (height - 1) * stride;
+			strides[0] = -stride;
+		}
+		size = stride * height;
+	}
+
+	if (data != nullptr) {
+		CopyMemory(data, planes, sizeof(planes));
+		CopyMemory(linesize, strides, sizeof(strides));
+	}
+
+	return size;
+}
+
+// offered after the decoder's own format, s32 carries 24 valid bits
+static const AVSampleFormat g_sample_fmt_out[] = {
+	AV_SAMPLE_FMT_FLT,
+	AV_SAMPLE_FMT_S32,
+	AV_SAMPLE_FMT_S16,
+};
+
+static AVSampleFormat get_sample_format_out(
+	unsigned int index, AVSampleFormat native)
+{
+	native = av_get_packed_sample_fmt(native);
+	switch (native)
+	{
+	case AV_SAMPLE_FMT_U8:
+	case AV_SAMPLE_FMT_S16:
+	case AV_SAMPLE_FMT_S32:
+	case AV_SAMPLE_FMT_FLT:
+		if (index == 0) {
+			return native;
+		}
+		index--;
+		break;
+	default:
+		break;
+	}
+
+	for (size_t i=0; i<ARRAYSIZE(g_sample_fmt_out); i++) {
+		if (g_sample_fmt_out[i] == native) {
+			continue;
+		}
+		if (index == 0) {
+			return g_sample_fmt_out[i];
+		}
+		index--;
+	}
+
+	return AV_SAMPLE_FMT_NONE;
+}
+
+static DWORD get_channel_mask(const AVChannelLayout *ch_layout, int channels)
+{
+	AVChannelLayout layout;
+	DWORD mask = 0;
+
+	if ((ch_layout->order == AV_CHANNEL_ORDER_NATIVE) &&
+		(ch_layout->nb_channels == channels)) {
+		mask = (DWORD)ch_layout->u.mask;
+	} else {
+		av_channel_layout_default(&layout, channels);
+		if (layout.order == AV_CHANNEL_ORDER_NATIVE) {
+			mask = (DWORD)layout.u.mask;
+		}
+		av_channel_layout_uninit(&layout);
 	}
 
-	wfx->wFormatTag = WAVE_FORMAT_PCM;
-	wfx->wBitsPerSample = 16;
+	// AV_CH_FRONT_LEFT .. AV_CH_TOP_BACK_RIGHT are the SPEAKER_* bits
+	if (mask & ~0x3ffffUL) {
+		mask = 0;
+	}
+
+	return mask;
+}
+
+bool get_format_audio_out(
+	unsigned int index, AVSampleFormat native,
+	const AVChannelLayout *ch_layout, WAVEFORMATEXTENSIBLE *wfex)
+{
+	WAVEFORMATEX *wfx = &wfex->Format;
+	WORD valid_bits;
+
+	switch (get_sample_format_out(index, native))
+	{
+	case AV_SAMPLE_FMT_U8:	wfx->wBitsPerSample = 8;	valid_bits = 8;		break;
+	case AV_SAMPLE_FMT_S16:	wfx->wBitsPerSample = 16;	valid_bits = 16;	break;
+	case AV_SAMPLE_FMT_S32:	wfx->wBitsPerSample = 32;	valid_bits = 24;	break;
+	case AV_SAMPLE_FMT_FLT:	wfx->wBitsPerSample = 32;	valid_bits = 32;	break;
+	default:
+		return false;
+	}
 	wfx->nBlockAlign = wfx->nChannels * wfx->wBitsPerSample / 8;
 	wfx->nAvgBytesPerSec = wfx->nSamplesPerSec * wfx->nBlockAlign;
 
+	// WAVEFORMATEX is kept for what it can describe, the old renderers
+	// know nothing else
+	if ((wfx->nChannels > 2) || (wfx->wBitsPerSample > 16)) {
+		wfx->wFormatTag = WAVE_FORMAT_EXTENSIBLE;
+		wfx->cbSize = sizeof(*wfex) - sizeof(*wfx);
+		wfex->Samples.wValidBitsPerSample = valid_bits;
+		wfex->dwChannelMask = get_channel_mask(ch_layout, wfx->nChannels);
+		wfex->SubFormat = (valid_bits == 32)?
+			MEDIASUBTYPE_IEEE_FLOAT:MEDIASUBTYPE_PCM;
+	} else {
+		wfx->wFormatTag = WAVE_FORMAT_PCM;
+		wfx->cbSize = 0;
+	}
+
 	return true;
 }
 
+void get_channel_layout(const WAVEFORMATEX *wfx, AVChannelLayout *ch_layout)
+{
+	const WAVEFORMATEXTENSIBLE *wfex = (const WAVEFORMATEXTENSIBLE *)wfx;
+
+	if ((wfx->wFormatTag == WAVE_FORMAT_EXTENSIBLE) &&
+		(wfx->cbSize >= sizeof(*wfex) - sizeof(*wfx)) &&
+		(av_popcount(wfex->dwChannelMask) == wfx->nChannels)) {
+		av_channel_layout_from_mask(ch_layout, wfex->dwChannelMask);
+	} else {
+		av_channel_layout_default(ch_layout, wfx->nChannels);
+	}
+}
+
 WORD get_wave_format_tag(AVCodecID codec_id)
 {
 	switch (codec_id)
@@ -194,13 +360,34 @@ WORD get_wave_format_tag(AVCodecID codec_id)
 
 AVSampleFormat get_sample_format(const WAVEFORMATEX *wfx)
 {
-	if (wfx->wFormatTag != WAVE_FORMAT_PCM) {
+	const WAVEFORMATEXTENSIBLE *wfex = (const WAVEFORMATEXTENSIBLE *)wfx;
+	WORD tag = wfx->wFormatTag;
+
+	if (tag == WAVE_FORMAT_EXTENSIBLE) {
+		if (wfx->cbSize < sizeof(*wfex) - sizeof(*wfx)) {
+			return AV_SAMPLE_FMT_NONE;
+		}
+		if (wfex->SubFormat == MEDIASUBTYPE_IEEE_FLOAT) {
+			tag = WAVE_FORMAT_IEEE_FLOAT;
+		} else if (wfex->SubFormat == MEDIASUBTYPE_PCM) {
+			tag = WAVE_FORMAT_PCM;
+		} else {
+			return AV_SAMPLE_FMT_NONE;
+		}
+	}
+
+	if (tag == WAVE_FORMAT_IEEE_FLOAT) {
+		return (wfx->wBitsPerSample == 32)?
+			AV_SAMPLE_FMT_FLT:AV_SAMPLE_FMT_NONE;
+	}
+	if (tag != WAVE_FORMAT_PCM) {
 		return AV_SAMPLE_FMT_NONE;
 	}
 	switch (wfx->wBitsPerSample)
 	{
 	case 8:		return AV_SAMPLE_FMT_U8;
 	case 16:	return AV_SAMPLE_FMT_S16;
+	case 32:	return AV_SAMPLE_FMT_S32;
 	default:	return AV_SAMPLE_FMT_NONE;
 	}
 }
@@ -0,0 +1,276 @@
+// Copyright (c) 2024 Takahiro Ishida
+// Licensed under the MIT License.
+
+#include "vcmdrv.h"
+
+using namespace ffmpeg_w32codec::vcmdrv;
+
+typedef struct {
+	LONG	in_width;
+	LONG	in_height;
+	DWORD	in_compression;
+	LONG	out_width;
+	LONG	out_height;
+	WORD	out_bits;
+	DWORD	out_compression;
+} cache_format_t;
+
+static void unlink_entry(frame_cache_t *cache, cache_entry_t *entry)
+{
+	if (entry->prev != nullptr) {
+		entry->prev->next = entry->next;
+	} else {
+		cache->head = entry->next;
+	}
+	if (entry->next != nullptr) {
+		entry->next->prev = entry->prev;
+	} else {
+		cache->tail = entry->prev;
+	}
+	entry->prev = nullptr;
+	entry->next = nullptr;
+}
+
+static void push_front(frame_cache_t *cache, cache_entry_t *entry)
+{
+	entry->prev = nullptr;
+	entry->next = cache->head;
+	if (cache->head != nullptr) {
+		cache->head->prev = entry;
+	} else {
+		cache->tail = entry;
+	}
+	cache->head = entry;
+}
+
+static void evict(frame_cache_t *cache, SIZE_T budget)
+{
+	cache_entry_t *entry;
+
+	while ((cache->tail != nullptr) && (cache->used > budget)) {
+		entry = cache->tail;
+		unlink_entry(cache, entry);
+		cache->used -= entry->size;
+		cache->count--;
+		HeapFree(GetProcessHeap(), 0, entry);
+	}
+}
+
+LRESULT cache::configure(ic_context_t *ic, SIZE_T budget)
+{
+	if (ic == nullptr) {
+		return ICERR_BADPARAM;
+	}
+
+	ic->cache.budget = budget;
+	if (ic->cache.replay_used > budget) {
+		// the decoder is fed again from the next miss
+		ic->cache.replay_full = true;
+		evict(&ic->cache, 0);
+	} else {
+		evict(&ic->cache, budget - ic->cache.replay_used);
+	}
+
+	return ICERR_OK;
+}
+
+LRESULT cache::get_stats(
+	ic_context_t *ic, ICFFMPEGCACHESTATS *desc, SIZE_T size)
+{
+	if (ic == nullptr) {
+		return ICERR_BADPARAM;
+	}
+	if ((desc == nullptr) || (size < sizeof(*desc))) {
+		LOGE("invalid structure size %u", size);
+		return ICERR_BADPARAM;
+	}
+
+	desc->dwSize	= sizeof(*desc);
+	desc->dwEntries	= ic->cache.count;
+	desc->cbBudget	= ic->cache.budget;
+	desc->cbUsed	= ic->cache.used + ic->cache.replay_used;
+	desc->qwHits	= ic->cache.hits;
+	desc->qwMisses	= ic->cache.misses;
+
+	return ICERR_OK;
+}
+
+// called on a keyframe, the decoder no longer depends on what came before
+void cache::restart(frame_cache_t *cache)
+{
+	drop_deferred(cache);
+	cache->replay_full = false;
+	cache->chained = false;
+}
+
+// A delta frame decodes to a different picture depending on the reference,
+// so its key also covers the key of the previous frame, back to a keyframe.
+bool cache::make_key(
+	frame_cache_t *cache, const ICDECOMPRESS *desc, uint8_t *key)
+{
+	cache_format_t fmt;
+	bool delta = (desc->dwFlags & ICDECOMPRESS_NOTKEYFRAME) != 0;
+
+	if ((cache->budget == 0) || (delta && !cache->chained) ||
+		(desc->lpInput == nullptr) || (desc->lpbiInput->biSizeImage == 0)) {
+		cache->chained = false;
+		return false;
+	}
+
+	if (cache->hash == nullptr) {
+		cache->hash = av_murmur3_alloc();
+		if (cache->hash == nullptr) {
+			LOGE("av_murmur3_alloc() failed.");
+			cache->chained = false;
+			return false;
+		}
+	}
+
+	ZeroMemory(&fmt, sizeof(fmt));
+	fmt.in_width		= desc->lpbiInput->biWidth;
+	fmt.in_height		= desc->lpbiInput->biHeight;
+	fmt.in_compression	= desc->lpbiInput->biCompression;
+	fmt.out_width		= desc->lpbiOutput->biWidth;
+	fmt.out_height		= desc->lpbiOutput->biHeight;
+	fmt.out_bits		= desc->lpbiOutput->biBitCount;
+	fmt.out_compression	= desc->lpbiOutput->biCompression;
+
+	av_murmur3_init(cache->hash);
+	av_murmur3_update(cache->hash,
+		(const uint8_t *)desc->lpInput, desc->lpbiInput->biSizeImage);
+	av_murmur3_update(cache->hash, (const uint8_t *)&fmt, sizeof(fmt));
+	if (delta) {
+		av_murmur3_update(cache->hash, cache->chain, sizeof(cache->chain));
+	}
+	av_murmur3_final(cache->hash, key);
+
+	CopyMemory(cache->chain, key, sizeof(cache->chain));
+	cache->chained = true;
+
+	return true;
+}
+
+// The payloads of the hits are kept to feed the decoder on the next miss,
+// and count against the budget.  Once they would not fit, the frames are
+// decoded until the next keyframe.
+bool cache::can_defer(frame_cache_t *cache, SIZE_T size)
+{
+	if (cache->replay_used + size > cache->budget) {
+		cache->replay_full = true;
+	}
+
+	return !cache->replay_full;
+}
+
+bool cache::fetch(
+	frame_cache_t *cache, const uint8_t *key, void *dst, SIZE_T size)
+{
+	cache_entry_t *entry;
+
+	for (entry = cache->head; entry != nullptr; entry = entry->next) {
+		if ((entry->size == size) &&
+			(0 == memcmp(entry->key, key, sizeof(entry->key)))) {
+			break;
+		}
+	}
+	if (entry == nullptr) {
+		cache->misses++;
+		return false;
+	}
+
+	if (entry != cache->head) {
+		unlink_entry(cache, entry);
+		push_front(cache, entry);
+	}
+	CopyMemory(dst, entry->data, size);
+	cache->hits++;
+
+	return true;
+}
+
+void cache::store(
+	frame_cache_t *cache, const uint8_t *key, const void *src, SIZE_T size)
+{
+	cache_entry_t *entry;
+
+	if ((size == 0) || (cache->replay_used + size > cache->budget)) {
+		return;
+	}
+	evict(cache, cache->budget - cache->replay_used - size);
+
+	entry = (cache_entry_t *)HeapAlloc(
+		GetProcessHeap(), 0, sizeof(*entry) + size);
+	if (entry == nullptr) {
+		LOGE("HeapAlloc(%u) failed.", sizeof(*entry) + size);
+		return;
+	}
+	CopyMemory(entry->key, key, sizeof(entry->key));
+	entry->size = size;
+	CopyMemory(entry->data, src, size);
+
+	push_front(cache, entry);
+	cache->used += size;
+	cache->count++;
+}
+
+void cache::defer(frame_cache_t *cache, const void *src, SIZE_T size)
+{
+	cache_replay_t *replay;
+
+	replay = (cache_replay_t *)HeapAlloc(
+		GetProcessHeap(), 0, sizeof(*replay) + size);
+	if (replay == nullptr) {
+		LOGE("HeapAlloc(%u) failed.", sizeof(*replay) + size);
+		return;
+	}
+	replay->next = nullptr;
+	replay->size = size;
+	CopyMemory(replay->data, src, size);
+	cache->replay_used += size;
+	evict(cache, cache->budget - cache->replay_used);
+
+	if (cache->replay_tail != nullptr) {
+		cache->replay_tail->next = replay;
+	} else {
+		cache->replay_head = replay;
+	}
+	cache->replay_tail = replay;
+}
+
+void cache::drop_deferred(frame_cache_t *cache)
+{
+	cache_replay_t *replay;
+
+	while (cache->replay_head != nullptr) {
+		replay = cache->replay_head;
+		cache->replay_head = replay->next;
+		HeapFree(GetProcessHeap(), 0, replay);
+	}
+	cache->replay_tail = nullptr;
+	cache->replay_used = 0;
+}
+
+void cache::flush(frame_cache_t *cache)
+{
+	cache_entry_t *entry;
+
+	while (cache->head != nullptr) {
+		entry = cache->head;
+		cache->head = entry->next;
+		HeapFree(GetProcessHeap(), 0, entry);
+	}
+	cache->tail = nullptr;
+	cache->used = 0;
+	cache->count = 0;
+
+	drop_deferred(cache);
+	cache->chained = false;
+}
+
+void cache::release(frame_cache_t *cache)
+{
+	flush(cache);
+	if (cache->hash != nullptr) {
+		av_freep(&cache->hash);
+	}
+}
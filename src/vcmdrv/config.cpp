@@ -0,0 +1,107 @@
+// Copyright (c) 2024 Takahiro Ishida
+// Licensed under the MIT License.
+
+#include "vcmdrv.h"
+
+#define CONFIG_REG_KEY	"Software\\ffmpeg-w32codec\\vcmdrv"
+
+using namespace ffmpeg_w32codec::vcmdrv;
+
+static void read_values(HKEY root, ICFFMPEGSTATE *state)
+{
+	static const struct {
+		LPCSTR	name;
+		size_t	offset;
+	} values[] = {
+		{ "Threads",		offsetof(ICFFMPEGSTATE, dwThreads) },
+		{ "Scaler",			offsetof(ICFFMPEGSTATE, dwScaler) },
+		{ "OutputBits",		offsetof(ICFFMPEGSTATE, dwOutputBits) },
+		{ "SkipPolicy",		offsetof(ICFFMPEGSTATE, dwSkipPolicy) },
+		{ "CacheBudget",	offsetof(ICFFMPEGSTATE, cbCacheBudget) },
+	};
+	HKEY hKey;
+	LONG ret;
+	DWORD type;
+	DWORD value;
+	DWORD size;
+	ICFFMPEGSTATE tmp = *state;
+
+	ret = RegOpenKeyExA(root, CONFIG_REG_KEY, 0, KEY_READ, &hKey);
+	if (ret != ERROR_SUCCESS) {
+		return;
+	}
+
+	for (size_t i=0; i<ARRAYSIZE(values); i++) {
+		size = sizeof(value);
+		ret = RegQueryValueExA(
+			hKey, values[i].name, nullptr, &type, (LPBYTE)&value, &size);
+		if ((ret != ERROR_SUCCESS) || (type != REG_DWORD)) {
+			continue;
+		}
+		*(DWORD *)((BYTE *)&tmp + values[i].offset) = value;
+	}
+
+	RegCloseKey(hKey);
+
+	if (config::validate(&tmp)) {
+		*state = tmp;
+	} else {
+		LOGW("ignored invalid settings in registry");
+	}
+}
+
+void config::load_defaults(ICFFMPEGSTATE *state)
+{
+	ZeroMemory(state, sizeof(*state));
+	state->dwSize		= sizeof(*state);
+	state->dwVersion	= ICFFMPEGSTATE_VERSION;
+	state->dwThreads	= 1;
+	state->dwScaler		= SWS_BILINEAR;
+	state->dwOutputBits	= 24;
+	state->dwSkipPolicy	= ICFFMPEG_SKIP_NONE;
+	state->cbCacheBudget	= 0;
+
+	read_values(HKEY_LOCAL_MACHINE, state);
+	read_values(HKEY_CURRENT_USER, state);
+}
+
+bool config::validate(const ICFFMPEGSTATE *state)
+{
+	if (state->dwSize != sizeof(*state)) {
+		LOGE("invalid structure size %u", state->dwSize);
+		return false;
+	}
+	if (state->dwVersion != ICFFMPEGSTATE_VERSION) {
+		LOGE("invalid version %u", state->dwVersion);
+		return false;
+	}
+	if (state->dwThreads > 64) {
+		LOGE("invalid threads %u", state->dwThreads);
+		return false;
+	}
+	if ((state->dwScaler & 0x7ff) == 0) {
+		LOGE("invalid scaler 0x%08x", state->dwScaler);
+		return false;
+	}
+	if (get_pixel_format(state->dwOutputBits) == AV_PIX_FMT_NONE) {
+		LOGE("invalid output bits %u", state->dwOutputBits);
+		return false;
+	}
+	if (state->dwSkipPolicy > ICFFMPEG_SKIP_NONREF) {
+		LOGE("invalid skip policy %u", state->dwSkipPolicy);
+		return false;
+	}
+
+	return true;
+}
+
+AVPixelFormat config::get_pixel_format(DWORD bits)
+{
+	switch (bits)
+	{
+	case 16:	return AV_PIX_FMT_RGB555LE;
+	case 24:	return AV_PIX_FMT_BGR24;
+	case 32:	return AV_PIX_FMT_BGR0;
+	default:	return AV_PIX_FMT_NONE;
+	}
+}
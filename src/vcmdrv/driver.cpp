@@ -15,6 +15,13 @@ static void log_callback(void *ptr, int level, const char *fmt, va_list vl)
 
 LRESULT driver::load(void)
 {
+	LARGE_INTEGER freq;
+
+	QueryPerformanceFrequency(&freq);
+	g_qpc_frequency = freq.QuadPart;
+
+	config::load_defaults(&g_default_state);
+
 	return DRV_OK;
 }
 
@@ -83,6 +90,11 @@ LRESULT driver::open(ICOPEN *desc)
 	ic->type = desc->fccType;
 	ic->handler = desc->fccHandler;
 	ic->codec = codec;
+	if (g_default_state.dwSize == 0) {
+		config::load_defaults(&g_default_state);
+	}
+	ic->state = g_default_state;
+	ic->cache.budget = ic->state.cbCacheBudget;
 
 	desc->dwVersion = 0;	// TODO
 	desc->pV1Reserved = nullptr;
@@ -96,6 +108,7 @@ LRESULT driver::open(ICOPEN *desc)
 LRESULT driver::close(ic_context_t *ic)
 {
 	if (ic != nullptr) {
+		stats::dump(ic);
 		if (ic->sws != nullptr) {
 			sws_freeContext(ic->sws);
 			ic->sws = nullptr;
@@ -112,6 +125,7 @@ LRESULT driver::close(ic_context_t *ic)
 		if (ic->avctx != nullptr) {
 			avcodec_free_context(&ic->avctx);
 		}
+		cache::release(&ic->cache);
 		HeapFree(GetProcessHeap(), 0, ic);
 	}
 	return DRV_OK;
@@ -5,6 +5,32 @@
 
 using namespace ffmpeg_w32codec::vcmdrv;
 
+static int replay_deferred(ic_context_t *ic)
+{
+	int ret = 0;
+	cache_replay_t *replay;
+
+	for (replay = ic->cache.replay_head; replay != nullptr;
+		replay = replay->next) {
+		ic->avpkt->data = replay->data;
+		ic->avpkt->size = replay->size;
+		ret = avcodec_send_packet(ic->avctx, ic->avpkt);
+		if (ret < 0) {
+			LOGE("avcodec_send_packet() failed. (%d:0x%08x)", ret, ret);
+			break;
+		}
+		ret = avcodec_receive_frame(ic->avctx, ic->frame);
+		if (ret < 0) {
+			LOGE("avcodec_receive_frame() failed. (%d)", ret);
+			break;
+		}
+		av_frame_unref(ic->frame);
+	}
+	cache::drop_deferred(&ic->cache);
+
+	return ret;
+}
+
 LRESULT ic::get_info(ICINFO *desc, SIZE_T size)
 {
 	if (size < sizeof(*desc)) {
@@ -24,6 +50,75 @@ LRESULT ic::get_info(ICINFO *desc, SIZE_T size)
 	return size;
 }
 
+LRESULT ic::get_state(ic_context_t *ic, LPVOID buf, SIZE_T size)
+{
+	if (ic == nullptr) {
+		return 0;
+	}
+	if (buf == nullptr) {
+		return sizeof(ic->state);
+	}
+	if (size < sizeof(ic->state)) {
+		LOGE("invalid structure size %u", size);
+		return 0;
+	}
+
+	CopyMemory(buf, &ic->state, sizeof(ic->state));
+
+	return sizeof(ic->state);
+}
+
+LRESULT ic::set_state(ic_context_t *ic, LPCVOID buf, SIZE_T size)
+{
+	ICFFMPEGSTATE state;
+
+	if (ic == nullptr) {
+		return 0;
+	}
+	if (buf == nullptr) {
+		state = g_default_state;
+	} else {
+		if (size < sizeof(state)) {
+			LOGE("invalid structure size %u", size);
+			return 0;
+		}
+		CopyMemory(&state, buf, sizeof(state));
+		if (!config::validate(&state)) {
+			return 0;
+		}
+	}
+
+	// threads and scaler take effect on the next ICM_DECOMPRESS_BEGIN
+	ic->state = state;
+	cache::configure(ic, ic->state.cbCacheBudget);
+
+	return sizeof(state);
+}
+
+LRESULT ic::decompress::get_format(
+	ic_context_t *ic, LPBITMAPINFO in, LPBITMAPINFO out)
+{
+	if (ic == nullptr) {
+		return ICERR_BADPARAM;
+	}
+	if (out == nullptr) {
+		return sizeof(BITMAPINFOHEADER);
+	}
+
+	ZeroMemory(&out->bmiHeader, sizeof(out->bmiHeader));
+	out->bmiHeader.biSize			= sizeof(out->bmiHeader);
+	out->bmiHeader.biWidth			= in->bmiHeader.biWidth;
+	out->bmiHeader.biHeight			= abs(in->bmiHeader.biHeight);
+	out->bmiHeader.biPlanes			= 1;
+	out->bmiHeader.biBitCount		= (WORD)ic->state.dwOutputBits;
+	out->bmiHeader.biCompression	= BI_RGB;
+	out->bmiHeader.biSizeImage		= out->bmiHeader.biHeight
+		* (((out->bmiHeader.biWidth * out->bmiHeader.biBitCount + 31) & ~31)
+			/ 8);
+
+	return ICERR_OK;
+}
+
 LRESULT ic::decompress::query(
 	ic_context_t *ic, LPBITMAPINFO in, LPBITMAPINFO out)
 {
@@ -31,7 +126,8 @@ LRESULT ic::decompress::query(
 		return ICERR_BADPARAM;
 	}
 
-	if (out->bmiHeader.biBitCount != 24) {
+	if (config::get_pixel_format(out->bmiHeader.biBitCount)
+		== AV_PIX_FMT_NONE) {
 		return ICERR_UNSUPPORTED;
 	}
 	if (out->bmiHeader.biCompression != BI_RGB) {
@@ -51,13 +147,8 @@ LRESULT ic::decompress::begin(
 		return ICERR_BADPARAM;
 	}
 
-	switch (out->bmiHeader.biBitCount)
-	{
-	case 24:
-		dst_fmt = AV_PIX_FMT_BGR24;
-		break;
-
-	default:
+	dst_fmt = config::get_pixel_format(out->bmiHeader.biBitCount);
+	if (dst_fmt == AV_PIX_FMT_NONE) {
 		LOGE("unsupported output bits %u", out->bmiHeader.biBitCount);
 		return ICERR_UNSUPPORTED;
 	}
@@ -65,6 +156,7 @@ LRESULT ic::decompress::begin(
 	if (ic->avctx != nullptr) {
 		avcodec_free_context(&ic->avctx);
 	}
+	cache::restart(&ic->cache);
 	ic->avctx = avcodec_alloc_context3(ic->codec);
 	if (ic->avctx == nullptr) {
 		LOGE("avcodec_alloc_context3() failed.");
@@ -73,6 +165,13 @@ LRESULT ic::decompress::begin(
 
 	ic->avctx->width = in->bmiHeader.biWidth;
 	ic->avctx->height = in->bmiHeader.biHeight;
+	// frame threading would delay the output of ICM_DECOMPRESS
+	ic->avctx->thread_count = ic->state.dwThreads;
+	ic->avctx->thread_type = FF_THREAD_SLICE;
+	if ((ic->state.dwThreads != 1) &&
+		!(ic->codec->capabilities & AV_CODEC_CAP_SLICE_THREADS)) {
+		LOGW("%s decodes with 1 thread, Threads ignored", ic->codec->name);
+	}
 	ret = avcodec_open2(ic->avctx, ic->codec, nullptr);
 	if (ret < 0) {
 		LOGE("avcodec_open2() failed. (%d)", ret);
@@ -100,8 +199,8 @@ LRESULT ic::decompress::begin(
 	ic->sws = sws_getContext(
 		ic->avctx->width, ic->avctx->height, ic->avctx->pix_fmt,
 		out->bmiHeader.biWidth, abs(out->bmiHeader.biHeight), dst_fmt,
-		SWS_BILINEAR, nullptr, nullptr, nullptr);
-	if (ret < 0) {
+		ic->state.dwScaler, nullptr, nullptr, nullptr);
+	if (ic->sws == nullptr) {
 		LOGE("sws_getContext() failed.");
 		return ICERR_UNSUPPORTED;
 	}
@@ -118,8 +217,15 @@ LRESULT ic::decompress::run(
 	int ret;
 	int h;
 	int pitch;
+	int len;
 	uint8_t *src;
 	uint8_t *dst;
+	uint8_t key[16];
+	bool cacheable;
+	SIZE_T image_size;
+	LONGLONG t0;
+	LONGLONG t1;
+	bool hurry;
 
 	if (ic == nullptr) {
 		return ICERR_BADPARAM;
@@ -129,34 +235,90 @@ LRESULT ic::decompress::run(
 		return ICERR_BADPARAM;
 	}
 
+	hurry = (ic->state.dwSkipPolicy != ICFFMPEG_SKIP_NONE) &&
+		(desc->dwFlags & (ICDECOMPRESS_HURRYUP | ICDECOMPRESS_PREROLL));
+
+	image_size = ic->pitch * abs(desc->lpbiOutput->biHeight);
+	if (!(desc->dwFlags & ICDECOMPRESS_NOTKEYFRAME)) {
+		cache::restart(&ic->cache);
+	}
+	cacheable = cache::make_key(&ic->cache, desc, key);
+	if (cacheable &&
+		cache::can_defer(&ic->cache, desc->lpbiInput->biSizeImage)) {
+		t0 = qpc();
+		if (cache::fetch(&ic->cache, key, desc->lpOutput, image_size)) {
+			ic->stats.copy += qpc() - t0;
+			ic->stats.frames++;
+			ic->stats.bytes_in += desc->lpbiInput->biSizeImage;
+			ic->stats.bytes_out += image_size;
+			// keep the payload so that the decoder can catch up on a miss
+			cache::defer(
+				&ic->cache, desc->lpInput, desc->lpbiInput->biSizeImage);
+			return ICERR_OK;
+		}
+	}
+
+	if ((ic->cache.replay_head != nullptr) && (replay_deferred(ic) < 0)) {
+		// the reference is lost, so is this frame's key
+		ic->cache.chained = false;
+		cacheable = false;
+	}
+
+	t0 = qpc();
+	if (hurry && (ic->state.dwSkipPolicy == ICFFMPEG_SKIP_NONREF)) {
+		ic->avctx->skip_frame = AVDISCARD_NONREF;
+	} else {
+		ic->avctx->skip_frame = AVDISCARD_DEFAULT;
+	}
 	ic->avpkt->data = (uint8_t *)desc->lpInput;
 	ic->avpkt->size = desc->lpbiInput->biSizeImage;
 	ret = avcodec_send_packet(ic->avctx, ic->avpkt);
 	if (ret < 0) {
 		LOGE("avcodec_send_packet() failed. (%d:0x%08x)", ret, ret);
+		ic->cache.chained = false;
 		return ICERR_UNSUPPORTED;
 	}
 
 	ret = avcodec_receive_frame(ic->avctx, ic->frame);
+	if ((ret == AVERROR(EAGAIN)) && hurry) {
+		ic->stats.decode += qpc() - t0;
+		return ICERR_DONTDRAW;
+	}
 	if (ret < 0) {
 		LOGE("avcodec_receive_frame() failed. (%d)", ret);
+		ic->cache.chained = false;
 		return ICERR_UNSUPPORTED;
 	}
 
+	t1 = qpc();
+	ic->stats.decode += t1 - t0;
+	ic->stats.decoded++;
+	t0 = t1;
+
+	if (hurry) {
+		// the frame will not be displayed, skip the conversion
+		av_frame_unref(ic->frame);
+		return ICERR_DONTDRAW;
+	}
+
 	ret = sws_scale_frame(ic->sws, ic->frame_sws, ic->frame);
 	if (ret < 0) {
 		LOGE("sws_scale_frame() failed. (%d)", ret);
 		return ICERR_UNSUPPORTED;
 	}
+	t1 = qpc();
+	ic->stats.scale += t1 - t0;
+	t0 = t1;
 
 	h = desc->lpbiOutput->biHeight;
-	pitch = ic->frame_sws->linesize[0];
+	pitch = FFMIN(ic->frame_sws->linesize[0], ic->pitch);
+	len = ic->frame_sws->linesize[0];
 	if (h > 0) {
-		src = (uint8_t *)ic->frame_sws->data[0] + (h - 1) * pitch;
+		src = (uint8_t *)ic->frame_sws->data[0] + (h - 1) * len;
 		dst = (uint8_t *)desc->lpOutput;
 		for (int y=0; y<h; y++) {
 			CopyMemory(dst, src, pitch);
-			src -= pitch;
+			src -= len;
 			dst += ic->pitch;
 		}
 	} else {
@@ -165,11 +327,19 @@ LRESULT ic::decompress::run(
 		h = -h;
 		for (int y=0; y<h; y++) {
 			CopyMemory(dst, src, pitch);
-			src += pitch;
+			src += len;
 			dst += ic->pitch;
 		}
 	}
 
+	if (cacheable) {
+		cache::store(&ic->cache, key, desc->lpOutput, image_size);
+	}
+	ic->stats.copy += qpc() - t0;
+	ic->stats.frames++;
+	ic->stats.bytes_in += desc->lpbiInput->biSizeImage;
+	ic->stats.bytes_out += image_size;
+
 	return ICERR_OK;
 }
 
@@ -195,6 +365,7 @@ LRESULT ic::decompress::end(ic_context_t *ic)
 	if (ic->avctx != nullptr) {
 		avcodec_free_context(&ic->avctx);
 	}
+	cache::drop_deferred(&ic->cache);
 
 	return ICERR_OK;
 }
@@ -6,6 +6,8 @@
 namespace ffmpeg_w32codec { namespace vcmdrv {
 	FOURCC g_fourcc_type;
 	FOURCC g_fourcc_handler;
+	LONGLONG g_qpc_frequency;
+	ICFFMPEGSTATE g_default_state;
 }}
 
 using namespace ffmpeg_w32codec;
@@ -93,6 +95,19 @@ extern "C" LRESULT CALLBACK DriverProc(
 		LOGD("ICM_GETINFO");
 		return vcmdrv::ic::get_info((ICINFO *)lParam1, lParam2);
 
+	case ICM_GETSTATE:
+		LOGD("ICM_GETSTATE");
+		return vcmdrv::ic::get_state(ic, (LPVOID)lParam1, lParam2);
+
+	case ICM_SETSTATE:
+		LOGD("ICM_SETSTATE");
+		return vcmdrv::ic::set_state(ic, (LPCVOID)lParam1, lParam2);
+
+	case ICM_DECOMPRESS_GET_FORMAT:
+		LOGD("ICM_DECOMPRESS_GET_FORMAT");
+		return vcmdrv::ic::decompress::get_format(
+			ic, (LPBITMAPINFO)lParam1, (LPBITMAPINFO)lParam2);
+
 	case ICM_DECOMPRESS_QUERY:
 		LOGD("ICM_DECOMPRESS_QUERY");
 		return vcmdrv::ic::decompress::query(
@@ -112,6 +127,19 @@ extern "C" LRESULT CALLBACK DriverProc(
 		LOGD("ICM_DECOMPRESS_END");
 		return vcmdrv::ic::decompress::end(ic);
 
+	case ICM_FFMPEG_SETCACHE:
+		LOGD("ICM_FFMPEG_SETCACHE");
+		return vcmdrv::cache::configure(ic, (SIZE_T)lParam1);
+
+	case ICM_FFMPEG_GETCACHESTATS:
+		LOGD("ICM_FFMPEG_GETCACHESTATS");
+		return vcmdrv::cache::get_stats(
+			ic, (ICFFMPEGCACHESTATS *)lParam1, lParam2);
+
+	case ICM_FFMPEG_GETSTATS:
+		LOGD("ICM_FFMPEG_GETSTATS");
+		return vcmdrv::stats::get(ic, (ICFFMPEGSTATS *)lParam1, lParam2);
+
 	default:
 		LOGD("%s: uMsg=0x%04x", __FUNCTION__, uMsg);
 		if (uMsg < DRV_USER) {
@@ -0,0 +1,94 @@
+// Copyright (c) 2024 Takahiro Ishida
+// Licensed under the MIT License.
+
+#include "vcmdrv.h"
+
+#include <stdio.h>
+
+#define STATS_ENV_NAME	"FFMPEG_W32CODEC_VCM_STATS"
+
+using namespace ffmpeg_w32codec::vcmdrv;
+
+static unsigned long long to_usec(ULONGLONG ticks)
+{
+	if (g_qpc_frequency == 0) {
+		return 0;
+	}
+	return (unsigned long long)(ticks * 1000000.0 / g_qpc_frequency);
+}
+
+LRESULT stats::get(ic_context_t *ic, ICFFMPEGSTATS *desc, SIZE_T size)
+{
+	if (ic == nullptr) {
+		return ICERR_BADPARAM;
+	}
+	if ((desc == nullptr) || (size < sizeof(*desc))) {
+		LOGE("invalid structure size %u", size);
+		return ICERR_BADPARAM;
+	}
+
+	desc->dwSize		= sizeof(*desc);
+	desc->dwReserved	= 0;
+	desc->qwFrequency	= g_qpc_frequency;
+	desc->qwFrames		= ic->stats.frames;
+	desc->qwDecoded		= ic->stats.decoded;
+	desc->qwBytesIn		= ic->stats.bytes_in;
+	desc->qwBytesOut	= ic->stats.bytes_out;
+	desc->qwDecodeTicks	= ic->stats.decode;
+	desc->qwScaleTicks	= ic->stats.scale;
+	desc->qwCopyTicks	= ic->stats.copy;
+
+	return ICERR_OK;
+}
+
+// Appends one JSON object per line to the file named by STATS_ENV_NAME.
+void stats::dump(ic_context_t *ic)
+{
+	char path[MAX_PATH];
+	char buf[1024];
+	char handler[5];
+	DWORD len;
+	DWORD written;
+	HANDLE hFile;
+	int ret;
+
+	len = GetEnvironmentVariableA(STATS_ENV_NAME, path, sizeof(path));
+	if ((len == 0) || (len >= sizeof(path))) {
+		return;
+	}
+
+	CopyMemory(handler, &ic->handler, 4);
+	handler[4] = '\0';
+
+	ret = sprintf_s(buf,
+		"{\"pid\":%lu,\"handler\":\"%s\",\"frames\":%llu,\"decoded\":%llu,"
+		"\"bytes_in\":%llu,\"bytes_out\":%llu,"
+		"\"decode_us\":%llu,\"scale_us\":%llu,\"copy_us\":%llu,"
+		"\"cache_hits\":%llu,\"cache_misses\":%llu}\r\n",
+		GetCurrentProcessId(), handler,
+		(unsigned long long)ic->stats.frames,
+		(unsigned long long)ic->stats.decoded,
+		(unsigned long long)ic->stats.bytes_in,
+		(unsigned long long)ic->stats.bytes_out,
+		to_usec(ic->stats.decode),
+		to_usec(ic->stats.scale),
+		to_usec(ic->stats.copy),
+		(unsigned long long)ic->cache.hits,
+		(unsigned long long)ic->cache.misses);
+	if (ret < 0) {
+		LOGE("sprintf_s() failed.");
+		return;
+	}
+
+	hFile = CreateFileA(
+		path, FILE_APPEND_DATA, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+		OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		LOGE("CreateFileA(%s) failed. (%u)", path, GetLastError());
+		return;
+	}
+	if (!WriteFile(hFile, buf, ret, &written, nullptr)) {
+		LOGE("WriteFile() failed. (%u)", GetLastError());
+	}
+	CloseHandle(hFile);
+}
@@ -9,13 +9,57 @@
 
 extern "C" {
 #include <libavcodec/avcodec.h>
+#include <libavutil/murmur3.h>
 #include <libswscale/swscale.h>
 }
 
 #define LOG_TAG "VCMDrv"
 #include "common.h"
+#include "vcmdrvmsg.h"
 
 namespace ffmpeg_w32codec { namespace vcmdrv {
+	typedef struct cache_entry {
+		struct cache_entry *	prev;
+		struct cache_entry *	next;
+		uint8_t					key[16];
+		SIZE_T					size;
+		uint8_t					data[1];
+	} cache_entry_t;
+
+	// compressed frames served from the cache since the decoder was last fed
+	typedef struct cache_replay {
+		struct cache_replay *	next;
+		SIZE_T					size;
+		uint8_t					data[1];
+	} cache_replay_t;
+
+	typedef struct {
+		SIZE_T				budget;
+		SIZE_T				used;
+		DWORD				count;
+		ULONGLONG			hits;
+		ULONGLONG			misses;
+		cache_entry_t *		head;	// most recently used
+		cache_entry_t *		tail;	// least recently used
+		cache_replay_t *	replay_head;
+		cache_replay_t *	replay_tail;
+		SIZE_T				replay_used;
+		bool				replay_full;	// no hits until the next keyframe
+		uint8_t				chain[16];	// key of the previous frame
+		bool				chained;	// false: delta frames are not cached
+		AVMurMur3 *			hash;
+	} frame_cache_t;
+
+	typedef struct {
+		ULONGLONG			frames;
+		ULONGLONG			decoded;
+		ULONGLONG			bytes_in;
+		ULONGLONG			bytes_out;
+		ULONGLONG			decode;		// QPC ticks
+		ULONGLONG			scale;		// QPC ticks
+		ULONGLONG			copy;		// QPC ticks
+	} ic_stats_t;
+
 	typedef struct {
 		FOURCC				type;
 		FOURCC				handler;
@@ -26,10 +70,22 @@ namespace ffmpeg_w32codec { namespace vcmdrv {
 		AVFrame *			frame_sws;
 		SwsContext *		sws;
 		int					pitch;
+		frame_cache_t		cache;
+		ic_stats_t			stats;
+		ICFFMPEGSTATE		state;
 	} ic_context_t;
 
 	extern FOURCC g_fourcc_type;
 	extern FOURCC g_fourcc_handler;
+	extern LONGLONG g_qpc_frequency;
+	extern ICFFMPEGSTATE g_default_state;
+
+	static inline LONGLONG qpc(void)
+	{
+		LARGE_INTEGER t;
+		QueryPerformanceCounter(&t);
+		return t.QuadPart;
+	}
 
 	namespace driver {
 		extern LRESULT load(void);
@@ -42,7 +98,12 @@ namespace ffmpeg_w32codec { namespace vcmdrv {
 
 	namespace ic {
 		extern LRESULT get_info(ICINFO *desc, SIZE_T size);
+		extern LRESULT get_state(ic_context_t *ic, LPVOID buf, SIZE_T size);
+		extern LRESULT set_state(
+			ic_context_t *ic, LPCVOID buf, SIZE_T size);
 		namespace decompress {
+			extern LRESULT get_format(
+				ic_context_t *ic, LPBITMAPINFO in, LPBITMAPINFO out);
 			extern LRESULT query(
 				ic_context_t *ic, LPBITMAPINFO in, LPBITMAPINFO out);
 			extern LRESULT begin(
@@ -52,4 +113,35 @@ namespace ffmpeg_w32codec { namespace vcmdrv {
 			extern LRESULT end(ic_context_t *ic);
 		}
 	}
+
+	namespace config {
+		extern void load_defaults(ICFFMPEGSTATE *state);
+		extern bool validate(const ICFFMPEGSTATE *state);
+		extern AVPixelFormat get_pixel_format(DWORD bits);
+	}
+
+	namespace stats {
+		extern LRESULT get(ic_context_t *ic, ICFFMPEGSTATS *desc, SIZE_T size);
+		extern void dump(ic_context_t *ic);
+	}
+
+	namespace cache {
+		extern LRESULT configure(ic_context_t *ic, SIZE_T budget);
+		extern LRESULT get_stats(
+			ic_context_t *ic, ICFFMPEGCACHESTATS *desc, SIZE_T size);
+		extern void restart(frame_cache_t *cache);
+		extern bool make_key(
+			frame_cache_t *cache, const ICDECOMPRESS *desc, uint8_t *key);
+		extern bool can_defer(frame_cache_t *cache, SIZE_T size);
+		extern bool fetch(
+			frame_cache_t *cache, const uint8_t *key, void *dst, SIZE_T size);
+		extern void store(
+			frame_cache_t *cache, const uint8_t *key,
+			const void *src, SIZE_T size);
+		extern void defer(
+			frame_cache_t *cache, const void *src, SIZE_T size);
+		extern void drop_deferred(frame_cache_t *cache);
+		extern void flush(frame_cache_t *cache);
+		extern void release(frame_cache_t *cache);
+	}
 }}
@@ -0,0 +1,467 @@
+// Copyright (c) 2024 Takahiro Ishida
+// Licensed under the MIT License.
+
+// usage: bench_msvfw32 <vcmdrv.dll> [<corpus.avi> ...]
+//
+// Decodes synthetic streams (and any given AVI files for FOURCCs that cannot
+// be synthesized) through ICDecompress and prints the results as JSON to
+// stdout.
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <vfw.h>
+#include <psapi.h>
+
+#include <assert.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <vector>
+
+#define LOG_TAG "Bench"
+#include "common.h"
+#include "vcmdrvmsg.h"
+
+#define SYNTHETIC_FRAMES	120
+#define SYNTHETIC_GOP		30
+
+// a skip code of Microsoft Video 1 covers up to this many blocks
+#define MSVC_MAX_SKIP		0x3ff
+
+typedef struct {
+	std::vector<BYTE>	data;
+	bool				key;
+} packet_t;
+
+typedef struct {
+	const char *			source;
+	BITMAPINFOHEADER		bi;
+	std::vector<packet_t>	packets;
+} stream_t;
+
+typedef struct {
+	FOURCC			handler;
+	FOURCC			compression;
+	WORD			bits;
+	bool			(*encode)(LONG width, LONG height, stream_t *stream);
+} codec_t;
+
+static bool encode_msvideo1(LONG width, LONG height, stream_t *stream);
+
+typedef struct {
+	LONG	divisor;	// output size = input size / divisor
+	bool	top_down;
+	WORD	bits;
+} output_t;
+
+static const codec_t g_codecs[] = {
+	{
+		mmioFOURCC('i', 'v', '5', '0'), mmioFOURCC('I', 'V', '5', '0'),
+		24, nullptr
+	},
+	{
+		mmioFOURCC('m', 's', 'v', 'c'), mmioFOURCC('M', 'S', 'V', 'C'),
+		16, encode_msvideo1
+	},
+};
+
+static const SIZE g_resolutions[] = {
+	{ 160, 120 },
+	{ 320, 240 },
+	{ 640, 480 },
+};
+
+static const output_t g_outputs[] = {
+	{ 1, false, 24 },
+	{ 1, true, 24 },
+	{ 2, false, 24 },
+	{ 1, false, 32 },
+	{ 1, false, 16 },
+};
+
+static bool g_first_result = true;
+
+// still gradient with a bouncing box, as RGB555
+static WORD synthetic_pixel(LONG width, LONG height, int n, LONG x, LONG y)
+{
+	int r = (x * 31 / width) & 31;
+	int g = (y * 31 / height) & 31;
+	int b = ((x + y) / 8) & 31;
+	int bx = (n * 4) % width;
+	int by = (n * 3) % height;
+
+	if ((x >= bx) && (x < bx + width / 8) &&
+		(y >= by) && (y < by + height / 8)) {
+		r = g = b = 31;
+	}
+
+	return (WORD)((r << 10) | (g << 5) | b);
+}
+
+static void put_word(std::vector<BYTE> *data, WORD value)
+{
+	data->push_back(LOBYTE(value));
+	data->push_back(HIBYTE(value));
+}
+
+static void put_skip(std::vector<BYTE> *data, int *skip)
+{
+	int count;
+
+	while (*skip > 0) {
+		count = std::min(*skip, MSVC_MAX_SKIP);
+		put_word(data, (WORD)(0x8400 | count));
+		*skip -= count;
+	}
+}
+
+// Microsoft Video 1 made of 2-color blocks only.  The blocks run from the
+// bottom left, and bit 0 of each mask is the bottom left pixel of the block;
+// a set bit selects the first color.  Between the keyframes, the blocks that
+// did not change are skipped, as over the still background.  The input to
+// the benchmark is made here so that the shipped FFmpeg needs no encoder.
+static bool encode_msvideo1(LONG width, LONG height, stream_t *stream)
+{
+	WORD pixels[16];
+	WORD colors[2];
+	WORD mask;
+	std::vector<WORD> prev;
+	size_t block;
+	int skip;
+
+	if (((width % 4) != 0) || ((height % 4) != 0)) {
+		return false;
+	}
+	prev.resize((width / 4) * (height / 4) * 3);
+
+	for (int n=0; n<SYNTHETIC_FRAMES; n++) {
+		packet_t packet;
+
+		packet.key = ((n % SYNTHETIC_GOP) == 0);
+		block = 0;
+		skip = 0;
+		for (LONG by=height/4-1; by>=0; by--) {
+			for (LONG bx=0; bx<width/4; bx++, block+=3) {
+				for (int i=0; i<16; i++) {
+					pixels[i] = synthetic_pixel(width, height, n,
+						bx * 4 + (i % 4), by * 4 + 3 - (i / 4));
+				}
+
+				// the top bit of the mask has to stay clear, so the last
+				// pixel takes the second color
+				colors[1] = pixels[15];
+				colors[0] = colors[1];
+				for (int i=0; i<16; i++) {
+					if (pixels[i] != colors[1]) {
+						colors[0] = pixels[i];
+						break;
+					}
+				}
+				mask = 0;
+				for (int i=0; i<16; i++) {
+					if (pixels[i] != colors[1]) {
+						mask |= 1 << i;
+					}
+				}
+
+				if (!packet.key && (prev[block] == mask) &&
+					(prev[block + 1] == colors[0]) &&
+					(prev[block + 2] == colors[1])) {
+					skip++;
+					continue;
+				}
+				prev[block] = mask;
+				prev[block + 1] = colors[0];
+				prev[block + 2] = colors[1];
+
+				put_skip(&packet.data, &skip);
+				put_word(&packet.data, mask);
+				put_word(&packet.data, colors[0]);
+				put_word(&packet.data, colors[1]);
+			}
+		}
+		put_skip(&packet.data, &skip);
+		stream->packets.push_back(packet);
+	}
+
+	ZeroMemory(&stream->bi, sizeof(stream->bi));
+	stream->bi.biSize			= sizeof(stream->bi);
+	stream->bi.biWidth			= width;
+	stream->bi.biHeight			= height;
+	stream->bi.biPlanes			= 1;
+	stream->bi.biBitCount		= 16;
+	stream->bi.biCompression	= mmioFOURCC('M', 'S', 'V', 'C');
+	stream->source = "synthetic";
+
+	return true;
+}
+
+static bool load_corpus(
+	const codec_t *codec, const char *path, stream_t *stream)
+{
+	HRESULT hr;
+	PAVIFILE file;
+	PAVISTREAM avi;
+	AVISTREAMINFOA info;
+	LONG size;
+	LONG len;
+	bool ret = false;
+
+	hr = AVIFileOpenA(&file, path, OF_READ, nullptr);
+	if (FAILED(hr)) {
+		return false;
+	}
+
+	hr = AVIFileGetStream(file, &avi, streamtypeVIDEO, 0);
+	if (FAILED(hr)) {
+		AVIFileRelease(file);
+		return false;
+	}
+
+	hr = AVIStreamInfoA(avi, &info, sizeof(info));
+	if (SUCCEEDED(hr) &&
+		((info.fccHandler | 0x20202020) == codec->handler)) {
+		size = sizeof(stream->bi);
+		hr = AVIStreamReadFormat(avi, 0, &stream->bi, &size);
+		if (SUCCEEDED(hr)) {
+			for (LONG i=AVIStreamStart(avi); i<AVIStreamEnd(avi); i++) {
+				packet_t packet;
+				len = 0;
+				hr = AVIStreamRead(
+					avi, i, 1, nullptr, 0, &size, nullptr);
+				if (FAILED(hr)) {
+					break;
+				}
+				packet.data.resize(size);
+				if (size > 0) {
+					hr = AVIStreamRead(
+						avi, i, 1, packet.data.data(), size, &len, nullptr);
+					if (FAILED(hr)) {
+						break;
+					}
+				}
+				packet.key = AVIStreamIsKeyFrame(avi, i) != FALSE;
+				stream->packets.push_back(packet);
+			}
+			stream->source = path;
+			ret = !stream->packets.empty();
+		}
+	}
+
+	AVIStreamRelease(avi);
+	AVIFileRelease(file);
+
+	return ret;
+}
+
+static double percentile(std::vector<double> &v, double p)
+{
+	size_t i;
+
+	if (v.empty()) {
+		return 0.0;
+	}
+	std::sort(v.begin(), v.end());
+	i = (size_t)(p / 100.0 * (v.size() - 1) + 0.5);
+
+	return v[i];
+}
+
+static void print_percentiles(const char *name, std::vector<double> &v)
+{
+	printf("\"%s\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"max\":%.1f}",
+		name, percentile(v, 50), percentile(v, 90), percentile(v, 99),
+		percentile(v, 100));
+}
+
+static void run(
+	const codec_t *codec, const stream_t *stream, const output_t *output)
+{
+	LRESULT ret;
+	HIC hic;
+	BITMAPINFOHEADER src_fmt;
+	BITMAPINFOHEADER dst_fmt;
+	ICFFMPEGSTATS s0;
+	ICFFMPEGSTATS s1;
+	ICFFMPEGSTATS first;
+	bool has_stats;
+	LARGE_INTEGER freq;
+	LARGE_INTEGER t0;
+	LARGE_INTEGER t1;
+	std::vector<double> total;
+	std::vector<double> decode;
+	std::vector<double> scale;
+	std::vector<double> copy;
+	std::vector<BYTE> bitmap;
+	double usec;
+	double elapsed = 0;
+	double frames;
+	char fourcc[5];
+
+	hic = ICOpen(ICTYPE_VIDEO, codec->handler, ICMODE_DECOMPRESS);
+	assert(hic != NULL);
+
+	src_fmt = stream->bi;
+	ZeroMemory(&dst_fmt, sizeof(dst_fmt));
+	dst_fmt.biSize			= sizeof(dst_fmt);
+	dst_fmt.biWidth			= src_fmt.biWidth / output->divisor;
+	dst_fmt.biHeight		= src_fmt.biHeight / output->divisor;
+	dst_fmt.biPlanes		= 1;
+	dst_fmt.biBitCount		= output->bits;
+	dst_fmt.biCompression	= BI_RGB;
+	if (output->top_down) {
+		dst_fmt.biHeight = -dst_fmt.biHeight;
+	}
+	dst_fmt.biSizeImage = abs(dst_fmt.biHeight)
+		* (((dst_fmt.biWidth * dst_fmt.biBitCount + 31) & ~31) / 8);
+
+	CopyMemory(fourcc, &codec->handler, 4);
+	fourcc[4] = '\0';
+
+	ret = ICDecompressQuery(hic, &src_fmt, &dst_fmt);
+	if (ret != ICERR_OK) {
+		ICClose(hic);
+		return;
+	}
+	ret = ICDecompressBegin(hic, &src_fmt, &dst_fmt);
+	assert(ret == ICERR_OK);
+
+	bitmap.resize(dst_fmt.biSizeImage);
+	QueryPerformanceFrequency(&freq);
+	s0.dwSize = sizeof(s0);
+	has_stats = (ICERR_OK == ICSendMessage(
+		hic, ICM_FFMPEG_GETSTATS, (DWORD_PTR)&s0, sizeof(s0)));
+	if (!has_stats) {
+		ZeroMemory(&s0, sizeof(s0));
+		s0.qwFrequency = 1;
+	}
+	first = s0;
+	s1 = s0;
+
+	for (const packet_t &packet : stream->packets) {
+		src_fmt.biSizeImage = (DWORD)packet.data.size();
+		QueryPerformanceCounter(&t0);
+		ret = ICDecompress(
+			hic, packet.key? 0:ICDECOMPRESS_NOTKEYFRAME, &src_fmt,
+			(LPVOID)packet.data.data(), &dst_fmt, bitmap.data());
+		QueryPerformanceCounter(&t1);
+		assert(ret == ICERR_OK);
+
+		usec = (t1.QuadPart - t0.QuadPart) * 1000000.0 / freq.QuadPart;
+		total.push_back(usec);
+		elapsed += usec / 1000000.0;
+
+		// outside the timed window, so that it is not part of the total
+		if (has_stats) {
+			s1.dwSize = sizeof(s1);
+			ICSendMessage(
+				hic, ICM_FFMPEG_GETSTATS, (DWORD_PTR)&s1, sizeof(s1));
+			decode.push_back((s1.qwDecodeTicks - s0.qwDecodeTicks)
+				* 1000000.0 / s1.qwFrequency);
+			scale.push_back((s1.qwScaleTicks - s0.qwScaleTicks)
+				* 1000000.0 / s1.qwFrequency);
+			copy.push_back((s1.qwCopyTicks - s0.qwCopyTicks)
+				* 1000000.0 / s1.qwFrequency);
+			s0 = s1;
+		}
+	}
+	frames = (double)stream->packets.size();
+
+	ret = ICDecompressEnd(hic);
+	assert(ret == ICERR_OK);
+	ret = ICClose(hic);
+	assert(ret == ICERR_OK);
+
+	printf("%s\n    {\"fourcc\":\"%s\",\"source\":\"", g_first_result? "":",",
+		fourcc);
+	for (const char *p = stream->source; *p != '\0'; p++) {
+		if ((*p == '\\') || (*p == '"')) {
+			putchar('\\');
+		}
+		putchar(*p);
+	}
+	printf("\",\"width\":%ld,\"height\":%ld,"
+		"\"out_width\":%ld,\"out_height\":%ld,\"out_bits\":%u,"
+		"\"frames\":%u,\"bytes_in\":%llu,\"fps\":%.1f,\"latency_us\":{",
+		stream->bi.biWidth, stream->bi.biHeight,
+		dst_fmt.biWidth, dst_fmt.biHeight, dst_fmt.biBitCount,
+		(unsigned int)stream->packets.size(),
+		(unsigned long long)(s1.qwBytesIn - first.qwBytesIn),
+		(elapsed > 0)? frames / elapsed:0.0);
+	print_percentiles("total", total);
+	putchar(',');
+	print_percentiles("decode", decode);
+	putchar(',');
+	print_percentiles("scale", scale);
+	putchar(',');
+	print_percentiles("copy", copy);
+	printf("}}");
+	g_first_result = false;
+}
+
+int main(int argc, char *argv[])
+{
+	LRESULT ret;
+	HMODULE hModule = NULL;
+	DRIVERPROC DriverProc = NULL;
+	PROCESS_MEMORY_COUNTERS pmc = {};
+
+	if (argc < 2) {
+		return -1;
+	}
+
+	assert(S_OK == CoInitialize(nullptr));
+	AVIFileInit();
+
+	hModule = LoadLibraryA(argv[1]);
+	assert(hModule != NULL);
+
+	DriverProc = (DRIVERPROC)GetProcAddress(hModule, "DriverProc");
+	assert(DriverProc != NULL);
+
+	printf("{\n  \"results\":[");
+
+	for (const codec_t &codec : g_codecs) {
+		std::vector<stream_t> streams;
+
+		ret = ICInstall(
+			ICTYPE_VIDEO, codec.handler, (LPARAM)DriverProc, nullptr,
+			ICINSTALL_FUNCTION);
+		assert(ret == TRUE);
+
+		if (codec.encode != nullptr) {
+			for (const SIZE &res : g_resolutions) {
+				stream_t stream;
+				if (codec.encode(res.cx, res.cy, &stream)) {
+					streams.push_back(stream);
+				}
+			}
+		}
+		for (int i=2; i<argc; i++) {
+			stream_t stream;
+			if (load_corpus(&codec, argv[i], &stream)) {
+				streams.push_back(stream);
+			}
+		}
+
+		for (const stream_t &stream : streams) {
+			for (const output_t &output : g_outputs) {
+				run(&codec, &stream, &output);
+			}
+		}
+
+		ret = ICRemove(ICTYPE_VIDEO, codec.handler, 0);
+		assert(ret == TRUE);
+	}
+
+	pmc.cb = sizeof(pmc);
+	GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc));
+	printf("\n  ],\n  \"peak_working_set\":%llu\n}\n",
+		(unsigned long long)pmc.PeakWorkingSetSize);
+
+	AVIFileExit();
+	FreeLibrary(hModule);
+	CoUninitialize();
+
+	return 0;
+}
@@ -0,0 +1,512 @@
+// Copyright (c) 2024 Takahiro Ishida
+// Licensed under the MIT License.
+
+// usage: bench_quartz <ffmpegds.ax> <media file> [<mode> [<seconds>]]
+//
+// mode:
+//   idle  CPU time consumed by a paused graph (default)
+//   seek  latency from IMediaSeeking::SetPositions() on a paused graph to the
+//         first frame after the seek reaching the renderer
+//   open  time to build and release the graph; the probe cache is emptied
+//         first, so the first open fills it and the rest use it
+//   scale frames decoded per second by 1, 2, 4 ... 64 graphs running at once
+//         without a clock, first with the threads of each filter and then
+//         with the shared pool ("SharedPool" is set in HKCU during the run,
+//         and "Threads" too, so that both passes decode with one thread);
+//         "baseline_threads" is the count of the process before the graphs
+//         of the step are built; the seconds are per step and the file
+//         should last longer
+//
+// The result is printed as JSON to stdout.
+
+#define INITGUID
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <dshow.h>
+#include <tlhelp32.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#define LOG_TAG "Bench"
+#include "common.h"
+
+#define CONFIG_REG_KEY	"Software\\ffmpeg-w32codec\\dsfilter"
+#define SCALE_MAX_GRAPHS	64
+#define SCALE_DECODER_THREADS	1
+
+using DLLGETCLASSOBJECT = HRESULT (WINAPI *)(REFCLSID, REFIID, LPVOID *);
+
+DEFINE_GUID(CLSID_FFmpegSplitter,
+	0xb0eb2d5c, 0x7474, 0x4a05,
+	0x9d, 0xb4, 0x36, 0x59, 0xf7, 0x08, 0x1a, 0x27);
+
+typedef struct {
+	IGraphBuilder *	pGraphBuilder;
+	IMediaControl *	pMediaControl;
+	IMediaSeeking *	pMediaSeeking;
+	IBaseFilter *	pFFmpegDSFilter;
+} graph_t;
+
+static DLLGETCLASSOBJECT g_pDllGetClassObject = nullptr;
+
+static double now_ms(void)
+{
+	LARGE_INTEGER freq;
+	LARGE_INTEGER t;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&t);
+
+	return t.QuadPart * 1000.0 / freq.QuadPart;
+}
+
+static double cpu_ms(void)
+{
+	FILETIME creation;
+	FILETIME exit;
+	FILETIME kernel;
+	FILETIME user;
+	ULARGE_INTEGER k;
+	ULARGE_INTEGER u;
+
+	GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+	k.LowPart = kernel.dwLowDateTime;
+	k.HighPart = kernel.dwHighDateTime;
+	u.LowPart = user.dwLowDateTime;
+	u.HighPart = user.dwHighDateTime;
+
+	return (k.QuadPart + u.QuadPart) / 10000.0;
+}
+
+static void build_graph(LPCWSTR path, graph_t *graph)
+{
+	HRESULT hr;
+	IClassFactory *pClassFactory = nullptr;
+	IBaseFilter *pSourceFilter = nullptr;
+	IEnumPins *pEnumPins = nullptr;
+	IPin *pPin = nullptr;
+	IPin *pPinSourceOut = nullptr;
+
+	ZeroMemory(graph, sizeof(*graph));
+
+	hr = CoCreateInstance(
+		CLSID_FilterGraph, nullptr, CLSCTX_INPROC_SERVER,
+		IID_PPV_ARGS(&graph->pGraphBuilder));
+	assert(SUCCEEDED(hr));
+	hr = graph->pGraphBuilder->QueryInterface(&graph->pMediaControl);
+	assert(SUCCEEDED(hr));
+	hr = graph->pGraphBuilder->QueryInterface(&graph->pMediaSeeking);
+	assert(SUCCEEDED(hr));
+
+	hr = g_pDllGetClassObject(
+		CLSID_FFmpegSplitter, IID_PPV_ARGS(&pClassFactory));
+	assert(SUCCEEDED(hr));
+	hr = pClassFactory->CreateInstance(
+		nullptr, IID_PPV_ARGS(&graph->pFFmpegDSFilter));
+	assert(SUCCEEDED(hr));
+	pClassFactory->Release();
+
+	hr = graph->pGraphBuilder->AddSourceFilter(path, L"Source", &pSourceFilter);
+	assert(SUCCEEDED(hr));
+	hr = graph->pGraphBuilder->AddFilter(
+		graph->pFFmpegDSFilter, L"Splitter/Decoder");
+	assert(SUCCEEDED(hr));
+
+	hr = pSourceFilter->EnumPins(&pEnumPins);
+	assert(SUCCEEDED(hr));
+	while (S_OK == pEnumPins->Next(1, &pPin, nullptr)) {
+		PIN_INFO info;
+		hr = pPin->QueryPinInfo(&info);
+		assert(SUCCEEDED(hr));
+		info.pFilter->Release();
+		if (info.dir == PINDIR_OUTPUT) {
+			pPinSourceOut = pPin;
+			break;
+		}
+		pPin->Release();
+	}
+	assert(pPinSourceOut != nullptr);
+	pEnumPins->Release();
+
+	hr = graph->pGraphBuilder->Render(pPinSourceOut);
+	assert(SUCCEEDED(hr));
+
+	pPinSourceOut->Release();
+	pSourceFilter->Release();
+}
+
+static void destroy_graph(graph_t *graph)
+{
+	graph->pMediaControl->Stop();
+	graph->pFFmpegDSFilter->Release();
+	graph->pMediaSeeking->Release();
+	graph->pMediaControl->Release();
+	graph->pGraphBuilder->Release();
+	ZeroMemory(graph, sizeof(*graph));
+}
+
+static void wait_state(graph_t *graph, FILTER_STATE state)
+{
+	HRESULT hr;
+	OAFilterState fs;
+
+	do {
+		hr = graph->pMediaControl->GetState(100, &fs);
+	} while (hr == VFW_S_STATE_INTERMEDIATE);
+	assert(SUCCEEDED(hr) && (fs == state));
+}
+
+static void bench_idle(LPCWSTR path, double seconds)
+{
+	HRESULT hr;
+	graph_t graph;
+	double t0;
+	double t1;
+	double c0;
+	double c1;
+
+	build_graph(path, &graph);
+
+	hr = graph.pMediaControl->Pause();
+	assert(SUCCEEDED(hr));
+	wait_state(&graph, State_Paused);
+
+	t0 = now_ms();
+	c0 = cpu_ms();
+	Sleep((DWORD)(seconds * 1000));
+	t1 = now_ms();
+	c1 = cpu_ms();
+
+	printf("{\"mode\":\"idle\",\"wall_ms\":%.1f,\"cpu_ms\":%.1f,"
+		"\"cpu_percent\":%.2f}\n",
+		t1 - t0, c1 - c0, (c1 - c0) * 100.0 / (t1 - t0));
+
+	destroy_graph(&graph);
+}
+
+static double percentile(std::vector<double> &v, double p)
+{
+	size_t i;
+
+	if (v.empty()) {
+		return 0.0;
+	}
+	std::sort(v.begin(), v.end());
+	i = (size_t)(p * (v.size() - 1) + 0.5);
+
+	return v[i];
+}
+
+static void bench_seek(LPCWSTR path, double seconds)
+{
+	HRESULT hr;
+	graph_t graph;
+	LONGLONG duration;
+	LONGLONG pos;
+	double t0;
+	double t1;
+	double end;
+	std::vector<double> latency;
+
+	build_graph(path, &graph);
+
+	hr = graph.pMediaSeeking->GetDuration(&duration);
+	assert(SUCCEEDED(hr) && (duration > 0));
+
+	hr = graph.pMediaControl->Pause();
+	assert(SUCCEEDED(hr));
+	wait_state(&graph, State_Paused);
+
+	// the paused graph stays in transition until the renderers receive the
+	// first sample of the new segment
+	srand(1);
+	end = now_ms() + seconds * 1000;
+	while (now_ms() < end) {
+		pos = (LONGLONG)(duration * (rand() / (RAND_MAX + 1.0)));
+		t0 = now_ms();
+		hr = graph.pMediaSeeking->SetPositions(
+			&pos, AM_SEEKING_AbsolutePositioning,
+			nullptr, AM_SEEKING_NoPositioning);
+		assert(SUCCEEDED(hr));
+		wait_state(&graph, State_Paused);
+		t1 = now_ms();
+		latency.push_back(t1 - t0);
+	}
+
+	printf("{\"mode\":\"seek\",\"seeks\":%zu,\"p50_ms\":%.1f,"
+		"\"p90_ms\":%.1f,\"max_ms\":%.1f}\n",
+		latency.size(), percentile(latency, 0.5),
+		percentile(latency, 0.9), percentile(latency, 1.0));
+
+	destroy_graph(&graph);
+}
+
+static void clear_probe_cache(void)
+{
+	WCHAR dir[MAX_PATH];
+	WCHAR file[MAX_PATH];
+	DWORD ret;
+	HANDLE hFind;
+	WIN32_FIND_DATAW data;
+
+	ret = GetEnvironmentVariableW(L"LOCALAPPDATA", dir, ARRAYSIZE(dir));
+	if ((ret == 0) || (ret >= ARRAYSIZE(dir))) {
+		return;
+	}
+	wcscat_s(dir, ARRAYSIZE(dir), L"\\ffmpeg-w32codec\\probe");
+
+	swprintf_s(file, ARRAYSIZE(file), L"%ls\\*.prb", dir);
+	hFind = FindFirstFileW(file, &data);
+	if (hFind == INVALID_HANDLE_VALUE) {
+		return;
+	}
+	do {
+		swprintf_s(file, ARRAYSIZE(file), L"%ls\\%ls", dir, data.cFileName);
+		DeleteFileW(file);
+	} while (FindNextFileW(hFind, &data));
+	FindClose(hFind);
+}
+
+static void bench_open(LPCWSTR path, double seconds)
+{
+	graph_t graph;
+	double t0;
+	double t1;
+	double first;
+	double end;
+	std::vector<double> latency;
+
+	clear_probe_cache();
+	t0 = now_ms();
+	build_graph(path, &graph);
+	destroy_graph(&graph);
+	first = now_ms() - t0;
+
+	end = now_ms() + seconds * 1000;
+	while (now_ms() < end) {
+		t0 = now_ms();
+		build_graph(path, &graph);
+		t1 = now_ms();
+		destroy_graph(&graph);
+		latency.push_back(t1 - t0);
+	}
+
+	printf("{\"mode\":\"open\",\"first_ms\":%.1f,\"opens\":%zu,"
+		"\"p50_ms\":%.1f,\"p90_ms\":%.1f,\"max_ms\":%.1f}\n",
+		first, latency.size(), percentile(latency, 0.5),
+		percentile(latency, 0.9), percentile(latency, 1.0));
+}
+
+static long count_frames(graph_t *graph)
+{
+	HRESULT hr;
+	IEnumPins *pEnumPins = nullptr;
+	IPin *pPin = nullptr;
+	IAMDroppedFrames *pDroppedFrames = nullptr;
+	long frames;
+	long total = 0;
+
+	hr = graph->pFFmpegDSFilter->EnumPins(&pEnumPins);
+	assert(SUCCEEDED(hr));
+	while (S_OK == pEnumPins->Next(1, &pPin, nullptr)) {
+		hr = pPin->QueryInterface(
+			IID_IAMDroppedFrames, (void **)&pDroppedFrames);
+		if (SUCCEEDED(hr)) {
+			if (SUCCEEDED(pDroppedFrames->GetNumNotDropped(&frames))) {
+				total += frames;
+			}
+			pDroppedFrames->Release();
+		}
+		pPin->Release();
+	}
+	pEnumPins->Release();
+
+	return total;
+}
+
+static int count_threads(void)
+{
+	HANDLE hSnapshot;
+	THREADENTRY32 te;
+	int count = 0;
+
+	hSnapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+	assert(hSnapshot != INVALID_HANDLE_VALUE);
+	te.dwSize = sizeof(te);
+	if (Thread32First(hSnapshot, &te)) {
+		do {
+			if (te.th32OwnerProcessID == GetCurrentProcessId()) {
+				count++;
+			}
+		} while (Thread32Next(hSnapshot, &te));
+	}
+	CloseHandle(hSnapshot);
+
+	return count;
+}
+
+// the DWORD value of the user, false if it is not set
+static bool save_value(HKEY hKey, const char *name, DWORD *value)
+{
+	LONG ret;
+	DWORD type;
+	DWORD size = sizeof(*value);
+
+	ret = RegQueryValueExA(
+		hKey, name, nullptr, &type, (LPBYTE)value, &size);
+
+	return (ret == ERROR_SUCCESS) && (type == REG_DWORD);
+}
+
+static void restore_value(HKEY hKey, const char *name, bool saved, DWORD value)
+{
+	if (saved) {
+		RegSetValueExA(hKey, name, 0, REG_DWORD,
+			(const BYTE *)&value, sizeof(value));
+	} else {
+		RegDeleteValueA(hKey, name);
+	}
+}
+
+static void bench_scale(LPCWSTR path, double seconds)
+{
+	HRESULT hr;
+	HKEY hKey;
+	LONG ret;
+	DWORD savedPool;
+	DWORD savedThreads;
+	bool restorePool;
+	bool restoreThreads;
+	DWORD pooled;
+	DWORD decoderThreads = SCALE_DECODER_THREADS;
+	IMediaFilter *pMediaFilter = nullptr;
+	std::vector<graph_t> graphs;
+	long f0;
+	long f1;
+	double t0;
+	double t1;
+	int threads;
+	int baseline;
+	const char *sep = "";
+
+	ret = RegCreateKeyExA(HKEY_CURRENT_USER, CONFIG_REG_KEY, 0, nullptr, 0,
+		KEY_READ | KEY_WRITE, nullptr, &hKey, nullptr);
+	assert(ret == ERROR_SUCCESS);
+	restorePool = save_value(hKey, "SharedPool", &savedPool);
+	restoreThreads = save_value(hKey, "Threads", &savedThreads);
+	// the pool defaults to 1, the filter threads to more: only the pool
+	// may differ between the passes
+	ret = RegSetValueExA(hKey, "Threads", 0, REG_DWORD,
+		(const BYTE *)&decoderThreads, sizeof(decoderThreads));
+	assert(ret == ERROR_SUCCESS);
+
+	printf("{\"mode\":\"scale\",\"results\":[");
+
+	// the pool outlives the filters, so it goes second
+	for (pooled=0; pooled<2; pooled++) {
+		ret = RegSetValueExA(hKey, "SharedPool", 0, REG_DWORD,
+			(const BYTE *)&pooled, sizeof(pooled));
+		assert(ret == ERROR_SUCCESS);
+
+		for (int n=1; n<=SCALE_MAX_GRAPHS; n*=2) {
+			// the pool starts with the first pooled graph, its workers are
+			// part of the baseline from the second step of that pass on
+			baseline = count_threads();
+			graphs.resize(n);
+			for (graph_t &graph : graphs) {
+				build_graph(path, &graph);
+				// as fast as the filters go
+				hr = graph.pGraphBuilder->QueryInterface(
+					IID_IMediaFilter, (void **)&pMediaFilter);
+				assert(SUCCEEDED(hr));
+				pMediaFilter->SetSyncSource(nullptr);
+				pMediaFilter->Release();
+			}
+			for (graph_t &graph : graphs) {
+				hr = graph.pMediaControl->Run();
+				assert(SUCCEEDED(hr));
+			}
+
+			f0 = 0;
+			for (graph_t &graph : graphs) {
+				f0 += count_frames(&graph);
+			}
+			t0 = now_ms();
+			Sleep((DWORD)(seconds * 1000));
+			threads = count_threads();
+			f1 = 0;
+			for (graph_t &graph : graphs) {
+				f1 += count_frames(&graph);
+			}
+			t1 = now_ms();
+
+			printf("%s{\"pool\":%lu,\"graphs\":%d,\"baseline_threads\":%d,"
+				"\"threads\":%d,\"fps\":%.1f}", sep, pooled, n, baseline,
+				threads, (f1 - f0) * 1000.0 / (t1 - t0));
+			fflush(stdout);
+			sep = ",";
+
+			for (graph_t &graph : graphs) {
+				destroy_graph(&graph);
+			}
+		}
+	}
+
+	printf("]}\n");
+
+	restore_value(hKey, "SharedPool", restorePool, savedPool);
+	restore_value(hKey, "Threads", restoreThreads, savedThreads);
+	RegCloseKey(hKey);
+}
+
+int main(int argc, char *argv[])
+{
+	WCHAR wbuf[MAX_PATH];
+	HMODULE hModule = NULL;
+	const char *mode = "idle";
+	double seconds = 5.0;
+
+	if (argc < 3) {
+		return -1;
+	}
+	MultiByteToWideChar(CP_UTF8, 0, argv[2], -1, wbuf, ARRAYSIZE(wbuf));
+	if (argc >= 4) {
+		mode = argv[3];
+	}
+	if (argc >= 5) {
+		seconds = atof(argv[4]);
+	}
+
+	assert(S_OK == CoInitialize(nullptr));
+
+	hModule = LoadLibraryA(argv[1]);
+	assert(hModule != NULL);
+
+	g_pDllGetClassObject =
+		(DLLGETCLASSOBJECT)GetProcAddress(hModule, "DllGetClassObject");
+	assert(g_pDllGetClassObject != nullptr);
+
+	if (0 == strcmp(mode, "idle")) {
+		bench_idle(wbuf, seconds);
+	} else if (0 == strcmp(mode, "seek")) {
+		bench_seek(wbuf, seconds);
+	} else if (0 == strcmp(mode, "open")) {
+		bench_open(wbuf, seconds);
+	} else if (0 == strcmp(mode, "scale")) {
+		bench_scale(wbuf, seconds);
+	} else {
+		fprintf(stderr, "unknown mode %s\n", mode);
+		return -1;
+	}
+
+	CoUninitialize();
+	FreeLibrary(hModule);
+
+	return 0;
+}
@@ -0,0 +1,114 @@
+// Copyright (c) 2024 Takahiro Ishida
+// Licensed under the MIT License.
+
+// usage: test_pcm
+//
+// Compares convert_fltp_to_s16()/convert_fltp_to_flt(), which take the SSE2
+// code where the CPU has it and leave the tail to the C code, with a plain
+// reference for 1, 2 and 6 channels and every length up to MAX_SAMPLES.
+
+#include "dsfilter.h"
+
+#include <math.h>
+#include <stdio.h>
+
+#define MAX_SAMPLES		37		// several SIMD blocks and every tail
+#define MAX_CHANNELS	6
+
+// ends of the range, beyond it, and halfway between two s16 steps
+static const float g_edges[] = {
+	1.0f, -1.0f, 1.0000001f, -1.0000001f, 1.5f, -1.5f, 4.0f, -4.0f,
+	1e10f, -1e10f, 0.0f, -0.0f, 0.5f / 32768.0f, 1.5f / 32768.0f,
+	-0.5f / 32768.0f, 32767.5f / 32768.0f, -32768.5f / 32768.0f,
+};
+
+static unsigned int g_seed = 1;
+
+static float next_sample(int n)
+{
+	if (n < (int)ARRAYSIZE(g_edges)) {
+		return g_edges[n];
+	}
+
+	// -2.0 to 2.0, a quarter of it out of range
+	g_seed = g_seed * 1103515245 + 12345;
+	return ((g_seed >> 8) & 0xffff) / 16384.0f - 2.0f;
+}
+
+static int16_t reference_s16(float x)
+{
+	// clipped to [-1.0, 1.0], rounded to the nearest even, 1.0 saturates
+	double v = (x < -1.0f)? -1.0:((x > 1.0f)? 1.0:x);
+
+	v = nearbyint(v * 32768.0);
+	return (int16_t)((v > 32767.0)? 32767.0:v);
+}
+
+static int test(int channels, int samples)
+{
+	float planes[MAX_CHANNELS][MAX_SAMPLES];
+	const float *src[MAX_CHANNELS];
+	int16_t s16[MAX_CHANNELS * MAX_SAMPLES + 1];
+	float flt[MAX_CHANNELS * MAX_SAMPLES + 1];
+	int errors = 0;
+	int n = 0;
+
+	for (int ch=0; ch<channels; ch++) {
+		for (int i=0; i<samples; i++) {
+			planes[ch][i] = next_sample(n++);
+		}
+		src[ch] = planes[ch];
+	}
+
+	// one past the end must stay untouched
+	s16[channels * samples] = 0x5a5a;
+	flt[channels * samples] = 12345.0f;
+
+	convert_fltp_to_s16(s16, src, channels, samples);
+	convert_fltp_to_flt(flt, src, channels, samples);
+
+	for (int i=0; i<samples; i++) {
+		for (int ch=0; ch<channels; ch++) {
+			int16_t expected = reference_s16(planes[ch][i]);
+			if (s16[i * channels + ch] != expected) {
+				printf("s16 ch %d/%d sample %d/%d: %.9g -> %d, expected %d\n",
+					ch, channels, i, samples, planes[ch][i],
+					s16[i * channels + ch], expected);
+				errors++;
+			}
+			if (flt[i * channels + ch] != planes[ch][i]) {
+				printf("flt ch %d/%d sample %d/%d: %.9g, expected %.9g\n",
+					ch, channels, i, samples, flt[i * channels + ch],
+					planes[ch][i]);
+				errors++;
+			}
+		}
+	}
+	if ((s16[channels * samples] != 0x5a5a) ||
+		(flt[channels * samples] != 12345.0f)) {
+		printf("overrun with %d channels, %d samples\n", channels, samples);
+		errors++;
+	}
+
+	return errors;
+}
+
+int main(int argc, char *argv[])
+{
+	static const int channels[] = { 1, 2, 6 };
+	int errors = 0;
+
+	printf("SSE2: %s\n",
+		IsProcessorFeaturePresent(PF_XMMI64_INSTRUCTIONS_AVAILABLE)?
+		"yes":"no");
+
+	for (int ch : channels) {
+		for (int samples=1; samples<=MAX_SAMPLES; samples++) {
+			errors += test(ch, samples);
+		}
+	}
+
+	printf("%s (%d errors)\n", (errors == 0)? "ok":"failed", errors);
+
+	return (errors == 0)? 0:1;
+}
@@ -0,0 +1,174 @@
+// Copyright (c) 2024 Takahiro Ishida
+// Licensed under the MIT License.
+
+// usage: bench_ring [<items>]
+//
+// Measures the cost of handing a pointer from one thread to another through
+// the CSPSCQueue used by the output pins, compared with the std::queue,
+// critical section and event pair it replaced.
+//
+// The result is printed as JSON to stdout.
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <queue>
+
+#include "spscqueue.h"
+
+#define QUEUE_SIZE	256
+
+// the former CFFmpegStreamOut::EnqueuePacket()/DequeuePacket()
+class CLockedQueue
+{
+public:
+	CLockedQueue() {
+		InitializeCriticalSection(&m_cs);
+		m_hEvent = CreateEvent(nullptr, TRUE, TRUE, nullptr);
+		m_hNotEmpty = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+	}
+
+	~CLockedQueue() {
+		CloseHandle(m_hEvent);
+		CloseHandle(m_hNotEmpty);
+		DeleteCriticalSection(&m_cs);
+	}
+
+	void Push(void *item) {
+		WaitForSingleObject(m_hEvent, INFINITE);
+		EnterCriticalSection(&m_cs);
+		m_queue.push(item);
+		SetEvent(m_hNotEmpty);
+		if (m_queue.size() >= QUEUE_SIZE) {
+			ResetEvent(m_hEvent);
+		}
+		LeaveCriticalSection(&m_cs);
+	}
+
+	void *Pop(void) {
+		void *item;
+		while (true) {
+			EnterCriticalSection(&m_cs);
+			if (!m_queue.empty()) {
+				break;
+			}
+			ResetEvent(m_hNotEmpty);
+			LeaveCriticalSection(&m_cs);
+			WaitForSingleObject(m_hNotEmpty, INFINITE);
+		}
+		item = m_queue.front();
+		m_queue.pop();
+		if (m_queue.empty()) {
+			ResetEvent(m_hNotEmpty);
+		}
+		SetEvent(m_hEvent);
+		LeaveCriticalSection(&m_cs);
+		return item;
+	}
+
+private:
+	CRITICAL_SECTION	m_cs;
+	HANDLE				m_hEvent;
+	HANDLE				m_hNotEmpty;
+	std::queue<void *>	m_queue;
+};
+
+typedef struct {
+	CLockedQueue *			locked;
+	CSPSCQueue<void *> *	ring;
+	size_t					items;
+} bench_t;
+
+static double now_ns(void)
+{
+	LARGE_INTEGER freq;
+	LARGE_INTEGER t;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&t);
+
+	return t.QuadPart * 1000000000.0 / freq.QuadPart;
+}
+
+static DWORD WINAPI produce(LPVOID lpParameter)
+{
+	bench_t *bench = (bench_t *)lpParameter;
+
+	for (size_t i=1; i<=bench->items; i++) {
+		if (bench->locked != nullptr) {
+			bench->locked->Push((void *)i);
+		} else {
+			bench->ring->Push((void *)i);
+		}
+	}
+	if (bench->ring != nullptr) {
+		bench->ring->SetEndOfStream();
+	}
+
+	return 0;
+}
+
+static double run(bench_t *bench)
+{
+	HANDLE hThread;
+	double t0;
+	double t1;
+	void *item;
+	size_t count = 0;
+
+	t0 = now_ns();
+	hThread = CreateThread(nullptr, 0, produce, bench, 0, nullptr);
+	assert(hThread != nullptr);
+
+	if (bench->locked != nullptr) {
+		while (count < bench->items) {
+			item = bench->locked->Pop();
+			assert((size_t)item == count + 1);
+			count++;
+		}
+	} else {
+		while (bench->ring->Pop(&item)) {
+			assert((size_t)item == count + 1);
+			count++;
+		}
+	}
+	t1 = now_ns();
+	assert(count == bench->items);
+
+	WaitForSingleObject(hThread, INFINITE);
+	CloseHandle(hThread);
+
+	return (t1 - t0) / bench->items;
+}
+
+int main(int argc, char *argv[])
+{
+	bench_t bench;
+	CLockedQueue locked;
+	CSPSCQueue<void *> ring(QUEUE_SIZE);
+	double locked_ns;
+	double ring_ns;
+
+	bench.items = 1000000;
+	if (argc >= 2) {
+		bench.items = strtoul(argv[1], nullptr, 0);
+	}
+
+	bench.locked = &locked;
+	bench.ring = nullptr;
+	locked_ns = run(&bench);
+
+	bench.locked = nullptr;
+	bench.ring = &ring;
+	ring_ns = run(&bench);
+
+	printf("{\"items\":%zu,\"queue_size\":%d,"
+		"\"locked_ns_per_item\":%.1f,\"spsc_ns_per_item\":%.1f}\n",
+		bench.items, QUEUE_SIZE, locked_ns, ring_ns);
+
+	return 0;
+}